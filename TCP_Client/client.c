@@ -161,7 +161,7 @@ int main(int argc, char *argv[]) {
             }       
         }
         else if (!in_game && !game_over) {
-            printf("1. LOGOUT\n2. MAKE MOVE\n3. STOP\n4. QUIT\nChoice: ");
+            printf("1. LOGOUT\n2. MAKE MOVE\n3. STOP\n4. QUIT\n5. VIEW STATE\nChoice: ");
             read_line(input, sizeof(input));
 
             if (strcmp(input, "1") == 0) {
@@ -186,6 +186,15 @@ int main(int argc, char *argv[]) {
                 current_match_id = -1;
             }
             else if (strcmp(input, "4") == 0) break;
+            else if (strcmp(input, "5") == 0) {
+                printf("Match id: ");
+                read_line(input, sizeof(input));
+
+                char line[BUF_SIZE];
+                snprintf(line, sizeof(line),
+                         "STATE match %d\r\n", atoi(input));
+                send_all(sock, line, strlen(line));
+            }
             else printf("Invalid choice\n");
         }
         else if (in_game) {
@@ -0,0 +1,349 @@
+// log_analyzer.c
+// Compile: gcc log_analyzer.c -o log_analyzer -lpthread
+// Usage: ./log_analyzer [-t threads] [-f] <server.log>
+//
+// Summarizes the server log per minute: moves, finished games, MOVE_FAIL
+// codes 241/242/243 and connection churn. The file is mmapped and split
+// into one chunk per thread on line boundaries; line splitting uses
+// memchr, which glibc vectorizes. With -f the tool keeps following the
+// file after the initial pass and prints each minute once it closes; the
+// still open minute is held back until then, so no minute is printed
+// twice. Ctrl-C prints the open minute and the final totals.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS 64
+#define FOLLOW_BUF_SIZE (1 << 20)
+#define FOLLOW_POLL_US 500000
+
+static volatile sig_atomic_t follow_stop = 0;
+
+// Counter slots, one per reported column
+enum {
+    C_MOVES,
+    C_FINISHED,
+    C_FAIL_241,
+    C_FAIL_242,
+    C_FAIL_243,
+    C_CONNECT,
+    C_DISCONNECT,
+    C_COUNT
+};
+
+static const char *column_names[C_COUNT] = {
+    "moves", "finished", "241", "242", "243", "connect", "disconnect"
+};
+
+// Counters for one minute, keyed as YYYYMMDDHHMM
+typedef struct {
+    long long minute;
+    long counts[C_COUNT];
+} minute_stats_t;
+
+typedef struct {
+    minute_stats_t *items;
+    size_t len;
+    size_t cap;
+} stats_list_t;
+
+typedef struct {
+    const char *begin;
+    const char *end;
+    stats_list_t stats;
+    long lines;
+} chunk_job_t;
+
+// Prefix after "[YYYY-MM-DD HH:MM:SS] " -> counter slot
+typedef struct {
+    const char *prefix;
+    size_t len;
+    int slot;
+} line_kind_t;
+
+#define KIND(p, s) { p, sizeof(p) - 1, s }
+static const line_kind_t line_kinds[] = {
+    KIND("MOVE OK:", C_MOVES),
+    KIND("MATCH RESULT:", C_FINISHED),
+    KIND("MOVE FAIL: not your turn", C_FAIL_241),
+    KIND("MOVE FAIL: out of range", C_FAIL_242),
+    KIND("MOVE FAIL: position occupied", C_FAIL_243),
+    KIND("CLIENT CONNECTED:", C_CONNECT),
+    KIND("CLIENT DISCONNECTED:", C_DISCONNECT),
+};
+#define N_KINDS (sizeof(line_kinds) / sizeof(line_kinds[0]))
+
+// Find the counters for a minute, appending or inserting as needed.
+// Log lines are time ordered, so the last entry is almost always a hit.
+static minute_stats_t *stats_get(stats_list_t *l, long long minute) {
+    if (l->len > 0 && l->items[l->len-1].minute == minute) return &l->items[l->len-1];
+
+    size_t pos = l->len;
+    if (l->len > 0 && l->items[l->len-1].minute > minute) {
+        size_t lo = 0, hi = l->len;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (l->items[mid].minute < minute) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo < l->len && l->items[lo].minute == minute) return &l->items[lo];
+        pos = lo;
+    }
+
+    if (l->len == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        minute_stats_t *items = realloc(l->items, cap * sizeof(*items));
+        if (!items) return NULL;
+        l->items = items;
+        l->cap = cap;
+    }
+    memmove(&l->items[pos+1], &l->items[pos], (l->len - pos) * sizeof(*l->items));
+    memset(&l->items[pos], 0, sizeof(*l->items));
+    l->items[pos].minute = minute;
+    l->len++;
+    return &l->items[pos];
+}
+
+// Parse "[YYYY-MM-DD HH:MM" into YYYYMMDDHHMM, -1 if malformed
+static long long parse_minute(const char *p, size_t len) {
+    static const int digit_pos[12] = { 1,2,3,4, 6,7, 9,10, 12,13, 15,16 };
+    if (len < 22 || p[0] != '[' || p[20] != ']') return -1;
+    long long v = 0;
+    for (int i = 0; i < 12; i++) {
+        unsigned d = (unsigned char)p[digit_pos[i]] - '0';
+        if (d > 9) return -1;
+        v = v * 10 + d;
+    }
+    return v;
+}
+
+// Classify one line (without newline) and bump its minute counter
+static void scan_line(stats_list_t *stats, const char *p, size_t len) {
+    long long minute = parse_minute(p, len);
+    if (minute < 0) return;
+
+    const char *msg = p + 22;
+    size_t msg_len = len - 22;
+    for (size_t k = 0; k < N_KINDS; k++) {
+        const line_kind_t *kind = &line_kinds[k];
+        if (msg_len >= kind->len && msg[0] == kind->prefix[0] &&
+            memcmp(msg, kind->prefix, kind->len) == 0) {
+            minute_stats_t *ms = stats_get(stats, minute);
+            if (ms) ms->counts[kind->slot]++;
+            return;
+        }
+    }
+}
+
+// Scan every complete line in [begin, end), return the end of the last one
+static const char *scan_buffer(stats_list_t *stats, const char *begin, const char *end, long *lines) {
+    const char *p = begin;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) break;
+        scan_line(stats, p, nl - p);
+        (*lines)++;
+        p = nl + 1;
+    }
+    return p;
+}
+
+static void *chunk_thread(void *arg) {
+    chunk_job_t *job = arg;
+    const char *rest = scan_buffer(&job->stats, job->begin, job->end, &job->lines);
+    // Last line of the file may lack a trailing newline
+    if (rest < job->end) {
+        scan_line(&job->stats, rest, job->end - rest);
+        job->lines++;
+    }
+    return NULL;
+}
+
+// Add all counters of src into dst
+static void stats_merge(stats_list_t *dst, const stats_list_t *src) {
+    for (size_t i = 0; i < src->len; i++) {
+        minute_stats_t *ms = stats_get(dst, src->items[i].minute);
+        if (!ms) continue;
+        for (int c = 0; c < C_COUNT; c++) ms->counts[c] += src->items[i].counts[c];
+    }
+}
+
+static void print_header(void) {
+    printf("%-16s", "minute");
+    for (int c = 0; c < C_COUNT; c++) printf(" %10s", column_names[c]);
+    printf("\n");
+}
+
+static void print_row(const minute_stats_t *ms) {
+    long long m = ms->minute;
+    printf("%04lld-%02lld-%02lld %02lld:%02lld",
+           m / 100000000, m / 1000000 % 100, m / 10000 % 100, m / 100 % 100, m % 100);
+    for (int c = 0; c < C_COUNT; c++) printf(" %10ld", ms->counts[c]);
+    printf("\n");
+}
+
+// Totals over the first n minutes
+static void print_totals(const stats_list_t *stats, size_t n, long lines) {
+    long totals[C_COUNT] = {0};
+    for (size_t i = 0; i < n; i++)
+        for (int c = 0; c < C_COUNT; c++) totals[c] += stats->items[i].counts[c];
+    printf("%-16s", "total");
+    for (int c = 0; c < C_COUNT; c++) printf(" %10ld", totals[c]);
+    printf("\n%ld lines scanned\n", lines);
+}
+
+// Initial pass over [0, size) using nthreads workers
+static int analyze_file(int fd, off_t size, int nthreads, stats_list_t *out, long *lines) {
+    if (size == 0) return 0;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) { perror("mmap"); return -1; }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    chunk_job_t jobs[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    const char *end = data + size;
+    const char *p = data;
+    int njobs = 0;
+    for (int i = 0; i < nthreads && p < end; i++) {
+        const char *chunk_end = (i == nthreads - 1) ? end : data + size / nthreads * (i + 1);
+        if (chunk_end < p) chunk_end = p;
+        if (chunk_end < end) {
+            const char *nl = memchr(chunk_end, '\n', end - chunk_end);
+            chunk_end = nl ? nl + 1 : end;
+        }
+        memset(&jobs[njobs], 0, sizeof(jobs[njobs]));
+        jobs[njobs].begin = p;
+        jobs[njobs].end = chunk_end;
+        p = chunk_end;
+        njobs++;
+    }
+
+    for (int i = 0; i < njobs; i++) {
+        if (pthread_create(&tids[i], NULL, chunk_thread, &jobs[i]) != 0) {
+            chunk_thread(&jobs[i]);
+            tids[i] = 0;
+        }
+    }
+    for (int i = 0; i < njobs; i++) {
+        if (tids[i]) pthread_join(tids[i], NULL);
+        stats_merge(out, &jobs[i].stats);
+        *lines += jobs[i].lines;
+        free(jobs[i].stats.items);
+    }
+
+    munmap((void *)data, size);
+    return 0;
+}
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    follow_stop = 1;
+}
+
+// Tail the file from offset, printing each minute once a later one
+// appears. *printed counts the minutes already shown.
+static void follow_file(int fd, off_t offset, stats_list_t *stats, size_t *printed, long *lines) {
+    char *buf = malloc(FOLLOW_BUF_SIZE);
+    if (!buf) return;
+    size_t pending = 0;
+
+    while (!follow_stop) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) break;
+        if (st.st_size < offset) {
+            // Truncated or rotated in place, start over
+            offset = 0;
+            pending = 0;
+        }
+        if (st.st_size == offset) {
+            usleep(FOLLOW_POLL_US);
+            continue;
+        }
+
+        ssize_t n = pread(fd, buf + pending, FOLLOW_BUF_SIZE - pending, offset);
+        if (n <= 0) { usleep(FOLLOW_POLL_US); continue; }
+        offset += n;
+        pending += n;
+
+        const char *rest = scan_buffer(stats, buf, buf + pending, lines);
+        pending = buf + pending - rest;
+        if (pending == FOLLOW_BUF_SIZE) pending = 0;  // Overlong line, drop it
+        memmove(buf, rest, pending);
+
+        while (*printed + 1 < stats->len) print_row(&stats->items[(*printed)++]);
+        fflush(stdout);
+    }
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int follow = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f")) != -1) {
+        if (opt == 't') nthreads = atoi(optarg);
+        else if (opt == 'f') follow = 1;
+        else {
+            fprintf(stderr, "Usage: %s [-t threads] [-f] <server.log>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-t threads] [-f] <server.log>\n", argv[0]);
+        return 1;
+    }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) { perror("open"); return 1; }
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror("fstat"); close(fd); return 1; }
+
+    // When following, stop at the last newline so the tail line is
+    // counted once it is complete rather than twice
+    off_t scan_size = st.st_size;
+    if (follow) {
+        char c;
+        while (scan_size > 0 && pread(fd, &c, 1, scan_size - 1) == 1 && c != '\n') scan_size--;
+    }
+
+    stats_list_t stats = {0};
+    long lines = 0;
+    if (analyze_file(fd, scan_size, nthreads, &stats, &lines) < 0) { close(fd); return 1; }
+
+    // When following, the newest minute may still grow: hold it back
+    size_t printed = stats.len;
+    if (follow && printed > 0) printed--;
+
+    print_header();
+    for (size_t i = 0; i < printed; i++) print_row(&stats.items[i]);
+    print_totals(&stats, printed, lines);
+
+    if (follow) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_stop_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        printf("\nfollowing %s ...\n", argv[optind]);
+        fflush(stdout);
+        follow_file(fd, scan_size, &stats, &printed, &lines);
+
+        // Stopped: the open minute is final now
+        while (printed < stats.len) print_row(&stats.items[printed++]);
+        print_totals(&stats, printed, lines);
+    }
+
+    free(stats.items);
+    close(fd);
+    return 0;
+}
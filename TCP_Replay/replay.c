@@ -0,0 +1,451 @@
+// replay.c
+// Compile: gcc replay.c -o replay -lpthread
+// Usage: ./replay [-f | -F] [-t timeout_ms] <server_ip> <port> <capture>...
+//
+// Drives a fresh server with connection captures written by
+// `server --capture <dir>`, one connection per capture file. Modes:
+//   default  send inbound bytes with their recorded timing
+//   -f       no idle time; a command goes out once every earlier command
+//            in recorded order, on any connection, has been answered, so
+//            responses are deterministic
+//   -F       no idle time and no cross-connection ordering, every
+//            connection runs flat out; interacting connections may then
+//            legitimately differ from the recording
+// In every mode a send first waits until the outbound bytes recorded
+// before it have arrived, so e.g. a reply move is not sent before its
+// OPPONENT_MOVE. Received bytes are compared with the recording and
+// throughput and latency (send -> recorded reply bytes received) are
+// reported.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+
+#define CAPTURE_MAGIC "TTTCAP1\n"
+#define CAPTURE_IN 0
+#define CAPTURE_OUT 1
+#define CAPTURE_CLOSE 2
+#define BUF_SIZE 4096
+#define START_DELAY_US 50000
+
+typedef struct {
+    int dir;
+    uint64_t at_us;          // offset from the earliest capture start
+    const char *data;
+    size_t len;
+    size_t seq;              // inbound/close: position in global send order
+    size_t reply_total;      // inbound: bytes this connection had received
+                             // before the next inbound on any connection
+} record_t;
+
+typedef struct {
+    const char *path;
+    char *file;              // whole capture, records point into it
+    record_t *records;
+    size_t n_records;
+    size_t out_total;        // recorded outbound bytes
+    uint64_t start_wall_us;  // wall clock when the connection was captured
+
+    int sock;
+    char *recv_buf;          // everything received, compared at the end
+    size_t recv_len;
+    size_t recv_cap;
+    int recv_closed;
+    pthread_mutex_t recv_mutex;
+    pthread_cond_t recv_cond;
+
+    uint64_t *latencies;     // microseconds
+    size_t n_latencies;
+    long lines_sent;
+    long timeouts;
+    int mismatch;            // 1 if received bytes differ from recording
+    size_t mismatch_at;
+    int failed;
+} conn_job_t;
+
+static struct sockaddr_in server_addr;
+enum { MODE_TIMED, MODE_ORDERED, MODE_FLAT_OUT };
+static int replay_mode = MODE_TIMED;
+static int timeout_ms = 2000;
+static uint64_t start_us = 0;
+
+// -f ordering: an inbound or close record may be acted on once every one
+// before it in global order is done (answered, or timed out)
+static pthread_mutex_t order_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t order_cond = PTHREAD_COND_INITIALIZER;
+static unsigned char *order_done;
+static size_t order_next = 0;    // lowest seq not yet done
+static size_t order_total = 0;
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_record_time(const void *a, const void *b) {
+    const record_t *x = *(record_t * const *)a, *y = *(record_t * const *)b;
+    return x->at_us < y->at_us ? -1 : x->at_us > y->at_us;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t t) {
+    uint64_t now = now_us();
+    if (t > now) usleep(t - now);
+}
+
+ssize_t send_all(int sock, const char *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t s = send(sock, buf + total, len - total, 0);
+        if (s <= 0) return s;
+        total += s;
+    }
+    return total;
+}
+
+static int get_varint(const char **p, const char *end, uint64_t *out) {
+    uint64_t v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = (unsigned char)*(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) { *out = v; return 0; }
+    }
+    return -1;
+}
+
+// Read a capture file into job->records
+static int load_capture(conn_job_t *job) {
+    FILE *f = fopen(job->path, "rb");
+    if (!f) { perror(job->path); return -1; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    job->file = malloc(size > 0 ? size : 1);
+    if (!job->file || fread(job->file, 1, size, f) != (size_t)size) { fclose(f); return -1; }
+    fclose(f);
+
+    size_t magic_len = sizeof(CAPTURE_MAGIC) - 1;
+    if ((size_t)size < magic_len || memcmp(job->file, CAPTURE_MAGIC, magic_len) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", job->path);
+        return -1;
+    }
+
+    const char *p = job->file + magic_len, *end = job->file + size;
+    if (get_varint(&p, end, &job->start_wall_us) < 0) {
+        fprintf(stderr, "%s: truncated header\n", job->path);
+        return -1;
+    }
+    size_t cap = 0;
+    uint64_t at = 0;
+    while (p < end) {
+        int dir = (unsigned char)*p++;
+        uint64_t delta, len;
+        if (get_varint(&p, end, &delta) < 0 || get_varint(&p, end, &len) < 0 || len > (uint64_t)(end - p)) {
+            fprintf(stderr, "%s: truncated record, replaying what came before\n", job->path);
+            break;
+        }
+        if (job->n_records == cap) {
+            cap = cap ? cap * 2 : 64;
+            record_t *r = realloc(job->records, cap * sizeof(*r));
+            if (!r) return -1;
+            job->records = r;
+        }
+        at += delta;
+        job->records[job->n_records++] = (record_t){ dir, at, p, (size_t)len, 0, 0 };
+        if (dir == CAPTURE_OUT) job->out_total += len;
+        p += len;
+    }
+    return 0;
+}
+
+static void *recv_thread(void *arg) {
+    conn_job_t *job = arg;
+    char buf[BUF_SIZE];
+    while (1) {
+        ssize_t n = recv(job->sock, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        pthread_mutex_lock(&job->recv_mutex);
+        if (n <= 0) {
+            job->recv_closed = 1;
+            pthread_cond_broadcast(&job->recv_cond);
+            pthread_mutex_unlock(&job->recv_mutex);
+            break;
+        }
+        if (job->recv_len + n > job->recv_cap) {
+            size_t cap = (job->recv_len + n) * 2;
+            char *b = realloc(job->recv_buf, cap);
+            if (b) { job->recv_buf = b; job->recv_cap = cap; }
+        }
+        if (job->recv_len + n <= job->recv_cap) {
+            memcpy(job->recv_buf + job->recv_len, buf, n);
+            job->recv_len += n;
+        }
+        pthread_cond_broadcast(&job->recv_cond);
+        pthread_mutex_unlock(&job->recv_mutex);
+    }
+    return NULL;
+}
+
+// Absolute CLOCK_REALTIME deadline timeout_ms from now
+static void make_deadline(struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) { deadline->tv_sec++; deadline->tv_nsec -= 1000000000; }
+}
+
+// Wait until at least want bytes have arrived; 0 on success, -1 on timeout
+static int wait_received(conn_job_t *job, size_t want) {
+    struct timespec deadline;
+    make_deadline(&deadline);
+
+    int r = 0;
+    pthread_mutex_lock(&job->recv_mutex);
+    while (job->recv_len < want && !job->recv_closed) {
+        if (pthread_cond_timedwait(&job->recv_cond, &job->recv_mutex, &deadline) == ETIMEDOUT) { r = -1; break; }
+    }
+    if (job->recv_len < want) r = -1;
+    pthread_mutex_unlock(&job->recv_mutex);
+    return r;
+}
+
+// Wait until every inbound record before seq is done
+static int wait_turn(size_t seq) {
+    struct timespec deadline;
+    make_deadline(&deadline);
+
+    int r = 0;
+    pthread_mutex_lock(&order_mutex);
+    while (order_next < seq) {
+        if (pthread_cond_timedwait(&order_cond, &order_mutex, &deadline) == ETIMEDOUT) { r = -1; break; }
+    }
+    pthread_mutex_unlock(&order_mutex);
+    return r;
+}
+
+static void mark_done(size_t seq) {
+    pthread_mutex_lock(&order_mutex);
+    order_done[seq] = 1;
+    while (order_next < order_total && order_done[order_next]) order_next++;
+    pthread_cond_broadcast(&order_cond);
+    pthread_mutex_unlock(&order_mutex);
+}
+
+// Mark this job's inbound records from index first on as done, so a
+// failed connection does not stall the others
+static void release_turns(conn_job_t *job, size_t first) {
+    for (size_t i = first; i < job->n_records; i++)
+        if (job->records[i].dir != CAPTURE_OUT) mark_done(job->records[i].seq);
+}
+
+// Shift each capture onto a common timeline and number inbound records
+// in global time order
+static int order_records(conn_job_t *jobs, int n_jobs) {
+    uint64_t base = UINT64_MAX;
+    for (int i = 0; i < n_jobs; i++)
+        if (jobs[i].start_wall_us < base) base = jobs[i].start_wall_us;
+
+    record_t **in = NULL;
+    size_t n_in = 0, cap = 0;
+    for (int i = 0; i < n_jobs; i++) {
+        for (size_t r = 0; r < jobs[i].n_records; r++) {
+            record_t *rec = &jobs[i].records[r];
+            rec->at_us += jobs[i].start_wall_us - base;
+            if (rec->dir == CAPTURE_OUT) continue;
+            if (n_in == cap) {
+                cap = cap ? cap * 2 : 256;
+                record_t **p = realloc(in, cap * sizeof(*p));
+                if (!p) { free(in); return -1; }
+                in = p;
+            }
+            in[n_in++] = rec;
+        }
+    }
+    qsort(in, n_in, sizeof(*in), cmp_record_time);
+    for (size_t i = 0; i < n_in; i++) in[i]->seq = i;
+
+    // The reply to a command is whatever its connection received before
+    // anything else happened; later bytes belong to other commands
+    for (int i = 0; i < n_jobs; i++) {
+        size_t out_before = 0;
+        for (size_t r = 0; r < jobs[i].n_records; r++) {
+            record_t *rec = &jobs[i].records[r];
+            if (rec->dir == CAPTURE_OUT) { out_before += rec->len; continue; }
+            uint64_t next_at = rec->seq + 1 < n_in ? in[rec->seq + 1]->at_us : UINT64_MAX;
+            rec->reply_total = out_before;
+            for (size_t j = r + 1; j < jobs[i].n_records && jobs[i].records[j].at_us <= next_at; j++)
+                if (jobs[i].records[j].dir == CAPTURE_OUT) rec->reply_total += jobs[i].records[j].len;
+                else break;
+        }
+    }
+    free(in);
+
+    order_total = n_in;
+    order_done = calloc(n_in + 1, 1);
+    return order_done ? 0 : -1;
+}
+
+static void *conn_thread(void *arg) {
+    conn_job_t *job = arg;
+    job->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (job->sock < 0 || connect(job->sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect");
+        job->failed = 1;
+        release_turns(job, 0);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(job->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    job->latencies = calloc(job->n_records + 1, sizeof(uint64_t));
+    pthread_t rt;
+    if (!job->latencies || pthread_create(&rt, NULL, recv_thread, job) != 0) {
+        job->failed = 1;
+        release_turns(job, 0);
+        close(job->sock);
+        return NULL;
+    }
+
+    sleep_until(start_us);
+    size_t out_before = 0;
+    int closed = 0;
+    for (size_t i = 0; i < job->n_records; i++) {
+        const record_t *rec = &job->records[i];
+        if (rec->dir == CAPTURE_OUT) { out_before += rec->len; continue; }
+
+        if (wait_received(job, out_before) < 0) job->timeouts++;
+        if (replay_mode == MODE_TIMED) sleep_until(start_us + rec->at_us);
+        else if (replay_mode == MODE_ORDERED && wait_turn(rec->seq) < 0) job->timeouts++;
+
+        if (rec->dir == CAPTURE_CLOSE) {
+            closed = 1;
+            shutdown(job->sock, SHUT_WR);
+            release_turns(job, i);
+            break;
+        }
+
+        uint64_t t = now_us();
+        if (send_all(job->sock, rec->data, rec->len) != (ssize_t)rec->len) {
+            job->failed = 1;
+            release_turns(job, i);
+            break;
+        }
+        for (size_t k = 0; k < rec->len; k++) if (rec->data[k] == '\n') job->lines_sent++;
+
+        if (rec->reply_total > out_before) {
+            if (wait_received(job, rec->reply_total) == 0) job->latencies[job->n_latencies++] = now_us() - t;
+            else job->timeouts++;
+        }
+        mark_done(rec->seq);
+    }
+
+    if (!closed) {
+        // Capture ended without a hangup (e.g. server stopped): wait for
+        // the recorded replies, then hang up ourselves
+        if (wait_received(job, job->out_total) < 0) job->timeouts++;
+        shutdown(job->sock, SHUT_WR);
+    }
+    pthread_join(rt, NULL);
+    close(job->sock);
+
+    size_t cmp = job->recv_len < job->out_total ? job->recv_len : job->out_total;
+    size_t o = 0;
+    for (size_t i = 0; i < job->n_records && !job->mismatch; i++) {
+        const record_t *rec = &job->records[i];
+        if (rec->dir != CAPTURE_OUT) continue;
+        for (size_t k = 0; k < rec->len; k++, o++) {
+            if (o >= cmp || job->recv_buf[o] != rec->data[k]) { job->mismatch = 1; job->mismatch_at = o; break; }
+        }
+    }
+    if (!job->mismatch && job->recv_len != job->out_total) { job->mismatch = 1; job->mismatch_at = cmp; }
+    return NULL;
+}
+
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "fFt:")) != -1) {
+        if (opt == 'f') replay_mode = MODE_ORDERED;
+        else if (opt == 'F') replay_mode = MODE_FLAT_OUT;
+        else if (opt == 't') timeout_ms = atoi(optarg);
+        else optind = argc + 1;
+    }
+    if (optind + 3 > argc) {
+        fprintf(stderr, "Usage: %s [-f | -F] [-t timeout_ms] <server_ip> <port> <capture>...\n", argv[0]);
+        return 1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Bad server address %s\n", argv[optind]);
+        return 1;
+    }
+
+    int n_jobs = argc - optind - 2;
+    conn_job_t *jobs = calloc(n_jobs, sizeof(conn_job_t));
+    pthread_t *tids = calloc(n_jobs, sizeof(pthread_t));
+    if (!jobs || !tids) { perror("calloc"); return 1; }
+    for (int i = 0; i < n_jobs; i++) {
+        jobs[i].path = argv[optind + 2 + i];
+        pthread_mutex_init(&jobs[i].recv_mutex, NULL);
+        pthread_cond_init(&jobs[i].recv_cond, NULL);
+        if (load_capture(&jobs[i]) < 0) return 1;
+    }
+    if (order_records(jobs, n_jobs) < 0) { perror("order_records"); return 1; }
+
+    start_us = now_us() + START_DELAY_US;
+    for (int i = 0; i < n_jobs; i++) {
+        if (pthread_create(&tids[i], NULL, conn_thread, &jobs[i]) != 0) { perror("pthread_create"); return 1; }
+    }
+
+    long lines = 0, timeouts = 0;
+    int mismatches = 0, failed = 0;
+    size_t n_lat = 0;
+    for (int i = 0; i < n_jobs; i++) {
+        pthread_join(tids[i], NULL);
+        lines += jobs[i].lines_sent;
+        timeouts += jobs[i].timeouts;
+        n_lat += jobs[i].n_latencies;
+        failed += jobs[i].failed;
+        if (jobs[i].mismatch) {
+            mismatches++;
+            fprintf(stderr, "MISMATCH %s at byte %zu (got %zu of %zu bytes)\n",
+                    jobs[i].path, jobs[i].mismatch_at, jobs[i].recv_len, jobs[i].out_total);
+        }
+    }
+    double secs = (now_us() - start_us) / 1e6;
+
+    uint64_t *lat = calloc(n_lat + 1, sizeof(uint64_t));
+    size_t k = 0;
+    for (int i = 0; lat && i < n_jobs; i++) {
+        memcpy(lat + k, jobs[i].latencies, jobs[i].n_latencies * sizeof(uint64_t));
+        k += jobs[i].n_latencies;
+    }
+    if (lat) qsort(lat, n_lat, sizeof(uint64_t), cmp_u64);
+
+    printf("connections    %d (%d failed)\n", n_jobs, failed);
+    static const char *mode_names[] = { "original timing", "fast, ordered", "fast, unordered" };
+    printf("mode           %s\n", mode_names[replay_mode]);
+    printf("commands       %ld in %.3f s (%.0f/s)\n", lines, secs, secs > 0 ? lines / secs : 0.0);
+    if (lat && n_lat > 0) {
+        printf("latency us     p50 %llu  p99 %llu  max %llu (%zu samples)\n",
+               (unsigned long long)lat[n_lat / 2], (unsigned long long)lat[n_lat * 99 / 100],
+               (unsigned long long)lat[n_lat - 1], n_lat);
+    }
+    printf("timeouts       %ld\n", timeouts);
+    printf("mismatches     %d\n", mismatches);
+
+    return (mismatches || failed) ? 2 : 0;
+}
@@ -1,6 +1,39 @@
 // server.c
 // Compile: gcc server.c -o server -lpthread
-// Usage: ./server <port>
+// Usage: ./server <port> [--handoff <path> [--takeover]]
+//                 [--cluster <host:port,...> --node <index>]
+//                 [--capture <dir>]
+//
+// With --handoff the server listens on a Unix socket at <path>. A new
+// binary started with the same path and --takeover connects there, and the
+// old process hands over the listening socket, every client socket and all
+// match state, then exits. Clients stay connected throughout.
+//
+// With --cluster every node runs the same list of internal link addresses
+// and its own --node index into it. Matches are owned by consistent
+// hashing on match id; MOVE/STOP/STATE for a match owned elsewhere are
+// forwarded to the owner, which relays replies back over the same link.
+// Remote clients are named by session id, which survives a hot restart.
+// Each node keeps a link to every other node and reconnects it in the
+// background; while a link is down, forwarded commands fail at once, and a
+// client too slow to take relayed replies is disconnected rather than
+// allowed to stall the link.
+// An owner drops a node's players when the link from it is lost. A hot
+// restart hands the links over with everything not yet read from them, so
+// other nodes do not notice it and no forwarded command or reply is lost.
+// To add a node, append it to the list: start the new node first, then
+// hot-restart every other node with the longer list. When a link to a node
+// comes up, only the matches on arcs it took over are sent to it (MIG);
+// until every node is updated, commands that nodes still on the old list
+// forward for moved matches are refused. A --takeover that removes or
+// reorders nodes, or changes --node, is refused and the old process keeps
+// running.
+// Example on one host:
+//   ./server 8081 --cluster 127.0.0.1:9001,127.0.0.1:9002 --node 0
+//   ./server 8082 --cluster 127.0.0.1:9001,127.0.0.1:9002 --node 1
+//
+// With --capture each connection's inbound and outbound bytes are recorded
+// with timestamps to <dir>/conn-<pid>-<n>.cap for TCP_Replay/replay.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,29 +43,111 @@
 #include <pthread.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include "trace.h"
 
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 static FILE *log_file = NULL;
 
 #define BOARD_N 3 
-
+#define MAX_FINISHED_KEPT 64
+
+// Writers still serialize on matches_mutex. Readers of id/board/turn/
+// is_finished/winner go through the per-match seqlock instead, so STATE
+// never touches matches_mutex. Nodes are recycled, never freed, so a
+// reader holding a stale pointer always sees a valid match_t. Fields the
+// reader copies are _Atomic: writers use plain (seq_cst) stores under the
+// mutex, the reader relaxed loads, ordered by the seq fences.
+// A won match stays listed with is_finished set so STATE can still show
+// the result; the next MOVE on that id starts a fresh game in place.
+// Only the MAX_FINISHED_KEPT most recent results are kept this way, older
+// ones are released so finished games never pile up in the list.
 typedef struct match_t {    
-    int id; 
+    atomic_int id; 
     int players[2]; 
-    int board[BOARD_N][BOARD_N];    
-    int turn; 
-    int is_finished; 
-    int winner; 
-    struct match_t *next; 
+    atomic_int board[BOARD_N][BOARD_N];    
+    atomic_int turn; 
+    atomic_int is_finished; 
+    atomic_int winner; 
+    atomic_int in_use;               // 0 once released to the free list
+    atomic_uint seq;                 // seqlock, odd while a write is in progress
+    _Atomic(struct match_t *) next;  // live list link, readable without lock
+    struct match_t *free_next;       // free list link, matches_mutex only
+    struct match_t *finished_next;   // finished list link, matches_mutex only
+    int finished_kept;               // on the finished list, matches_mutex only
 } match_t;
 
-static match_t *matches = NULL; 
+// Public part of a match, as returned by snapshot_match()
+typedef struct {
+    int board[BOARD_N][BOARD_N];
+    int turn;
+    int is_finished;
+    int winner;
+} match_snapshot_t;
+
+static _Atomic(match_t *) matches = NULL; 
+static match_t *free_matches = NULL; 
+static match_t *finished_head = NULL;    // oldest finished match still listed
+static match_t *finished_tail = NULL;
+static int finished_count = 0;
 pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER; 
 static pthread_mutex_t matches_mutex = PTHREAD_MUTEX_INITIALIZER; 
 
 #define BACKLOG 10
 #define BUF_SIZE 4096
 #define USERS_FILE "users.txt"
+#define MAX_SESSIONS 1024
+#define SESSION_SLOT_BITS 10   // log2(MAX_SESSIONS)
+
+// One connected client. linebuf lives here rather than on the thread
+// stack so a partially received line survives a hot restart.
+// id is gen << SESSION_SLOT_BITS | slot. Unlike sock it is kept across a
+// hot restart and never reused right away, so other cluster nodes name
+// the client by id.
+typedef struct {
+    int sock;
+    int id;              // 0 once the session is closing
+    unsigned gen;        // bumped each time the slot is reused
+    int pins;            // DLV senders using sock, see session_pin()
+    int active;          // slot in use
+    int parked;          // thread stopped for handoff, sock left open
+    pthread_t thread;
+    char linebuf[BUF_SIZE];
+    size_t linepos;
+    int line_too_long;   // dropping the rest of a line longer than linebuf
+    FILE *capture;                   // capture_mutex, NULL unless --capture
+    pthread_mutex_t capture_mutex;
+    uint64_t capture_last_us;
+    uint64_t capture_flush_us;
+} session_t;
+
+// Players connected through another cluster node are stored in
+// match_t.players as REMOTE_PLAYER_BASE | origin_node << 20 | session id
+#define REMOTE_PLAYER_BASE 0x40000000
+#define REMOTE_SESSION_MASK 0xFFFFF
+#define is_remote_player(p) (((p) & REMOTE_PLAYER_BASE) != 0)
+#define remote_player(node, id) (REMOTE_PLAYER_BASE | ((node) << 20) | (id))
+#define remote_node(p) (((p) & ~REMOTE_PLAYER_BASE) >> 20)
+#define remote_session(p) ((p) & REMOTE_SESSION_MASK)
+
+static int cluster_deliver(int player, const char *msg);
+static int cluster_route(int client_sock, int match_id, const char *line);
+static void cluster_client_gone(int session_id);
+static void cluster_migrate_to(int node);
+static void cluster_adopt_match(int node, const void *payload, size_t len);
+
+static session_t sessions[MAX_SESSIONS];
+static __thread int current_session_id = 0;   // set by client_thread
+static __thread int on_link_thread = 0;       // client sends must not block, see send_client
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int draining = 0;               // set while threads are parked for handoff
 
 
 // Status codes
@@ -51,6 +166,26 @@ static pthread_mutex_t matches_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define STR_RESULT_INSUFFICIENT "351 RESULT_FAIL insufficient_moves\r\n"
 
 
+// Trace command codes
+#define STR_TRACE_OK "190 TRACE_OK\r\n"
+#define STR_TRACE_FAIL_DISABLED "390 TRACE_FAIL not_compiled_in\r\n"
+#define STR_TRACE_FAIL_DUMP "390 TRACE_FAIL dump_error\r\n"
+#define STR_TRACE_FAIL_FORMAT "390 TRACE_FAIL format_error\r\n"
+#define STR_TRACE_FAIL_DENIED "390 TRACE_FAIL not_local\r\n"
+#define STR_TRACE_FAIL_BUSY "390 TRACE_FAIL too_frequent\r\n"
+
+
+// Batch codes
+#define STR_MULTI_FAIL_UNSUPPORTED "245 MULTI_FAIL unsupported_command\r\n"
+#define STR_MULTI_FAIL_EMPTY "245 MULTI_FAIL empty\r\n"
+#define STR_MULTI_FAIL_TOO_LONG "245 MULTI_FAIL too_long\r\n"
+
+
+// Match state query codes
+#define STR_STATE_FAIL_NOT_FOUND "380 STATE_FAIL match_not_found\r\n"
+#define STR_STATE_FAIL_FORMAT "380 STATE_FAIL format_error\r\n"
+
+
 // Trim CRLF
 static void trim_crlf(char *s) {
     size_t n = strlen(s);
@@ -59,7 +194,9 @@ static void trim_crlf(char *s) {
 
 // Log message with timestamp
 static void log_message(const char *format, ...) {
+    TRACE_BEGIN("log_mutex wait");
     pthread_mutex_lock(&log_mutex);
+    TRACE_END("log_mutex wait");
     if (log_file) {
         time_t now = time(NULL);
         struct tm *timeinfo = localtime(&now);
@@ -71,7 +208,9 @@ static void log_message(const char *format, ...) {
         vfprintf(log_file, format, args);
         va_end(args);
         fprintf(log_file, "\n");
+        TRACE_BEGIN("fflush");
         fflush(log_file);
+        TRACE_END("fflush");
     }
     pthread_mutex_unlock(&log_mutex);
 }
@@ -131,51 +270,297 @@ int register_user(const char *username, const char *password) {
     return 1;
 }
 
-// Send all data
-ssize_t send_all(int sock, const char *buf, size_t len) {
+// Session capture. File layout: CAPTURE_MAGIC, varint wall clock start in
+// microseconds, then records of
+// { u8 direction, varint delta_us since previous record, varint len, bytes }.
+// A CAPTURE_CLOSE record with no bytes marks the client hanging up.
+// Records are buffered and flushed at most once per CAPTURE_FLUSH_US, so
+// capturing adds no syscalls per request; a crash can lose the last
+// second of a connection.
+#define CAPTURE_MAGIC "TTTCAP1\n"
+#define CAPTURE_IN 0
+#define CAPTURE_OUT 1
+#define CAPTURE_CLOSE 2
+#define CAPTURE_MAX_FD 4096
+#define CAPTURE_FLUSH_US 1000000
+
+static const char *capture_dir = NULL;
+static atomic_int capture_seq = 0;
+static _Atomic(session_t *) capture_by_fd[CAPTURE_MAX_FD];   // read by send_all in any thread
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put_varint(FILE *f, uint64_t v) {
+    while (v >= 0x80) { fputc((int)(v & 0x7f) | 0x80, f); v >>= 7; }
+    fputc((int)v, f);
+}
+
+static void capture_open(session_t *sess) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/conn-%d-%d.cap", capture_dir, (int)getpid(), atomic_fetch_add(&capture_seq, 1));
+    FILE *f = fopen(path, "wb");
+    if (!f) { log_message("CAPTURE FAIL: cannot open %s", path); return; }
+    fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC) - 1, f);
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    put_varint(f, (uint64_t)wall.tv_sec * 1000000 + wall.tv_nsec / 1000);
+
+    pthread_mutex_lock(&sess->capture_mutex);
+    sess->capture = f;
+    sess->capture_last_us = sess->capture_flush_us = now_us();
+    pthread_mutex_unlock(&sess->capture_mutex);
+    if (sess->sock >= 0 && sess->sock < CAPTURE_MAX_FD) atomic_store(&capture_by_fd[sess->sock], sess);
+}
+
+static void capture_record(session_t *sess, int dir, const char *buf, size_t len) {
+    pthread_mutex_lock(&sess->capture_mutex);
+    if (sess->capture) {
+        uint64_t now = now_us();
+        fputc(dir, sess->capture);
+        put_varint(sess->capture, now - sess->capture_last_us);
+        put_varint(sess->capture, len);
+        fwrite(buf, 1, len, sess->capture);
+        sess->capture_last_us = now;
+        if (now - sess->capture_flush_us >= CAPTURE_FLUSH_US) {
+            fflush(sess->capture);
+            sess->capture_flush_us = now;
+        }
+    }
+    pthread_mutex_unlock(&sess->capture_mutex);
+}
+
+// hangup: the connection ends here, as opposed to moving to a successor
+static void capture_close(session_t *sess, int hangup) {
+    if (sess->sock >= 0 && sess->sock < CAPTURE_MAX_FD) {
+        session_t *expected = sess;
+        atomic_compare_exchange_strong(&capture_by_fd[sess->sock], &expected, NULL);
+    }
+    if (hangup) capture_record(sess, CAPTURE_CLOSE, "", 0);
+    pthread_mutex_lock(&sess->capture_mutex);
+    if (sess->capture) fclose(sess->capture);
+    sess->capture = NULL;
+    pthread_mutex_unlock(&sess->capture_mutex);
+}
+
+// Send all data, with send(2) flags
+static ssize_t send_all_flags(int sock, const char *buf, size_t len, int flags) {
     size_t total = 0;
+    if (capture_dir && sock >= 0 && sock < CAPTURE_MAX_FD) {
+        session_t *sess = atomic_load(&capture_by_fd[sock]);
+        if (sess) capture_record(sess, CAPTURE_OUT, buf, len);
+    }
+    TRACE_BEGIN("send_all");
     while (total < len) {
-        ssize_t s = send(sock, buf + total, len - total, 0);
-        if (s <= 0) return s;
+        ssize_t s = send(sock, buf + total, len - total, flags);
+        if (s < 0 && errno == EINTR) continue;   // SIGUSR2 from quiesce_threads
+        if (s <= 0) { TRACE_END("send_all"); return s; }
         total += s;
     }
+    TRACE_END("send_all");
     return total;
 }
 
+// Send all data
+ssize_t send_all(int sock, const char *buf, size_t len) {
+    return send_all_flags(sock, buf, len, 0);
+}
+
+// Send to a local client. A link thread serves every client behind its
+// link, so there a client that stopped reading is disconnected instead of
+// waited for; its own thread sees the shutdown and cleans up.
+static void send_client(int sock, const char *buf, size_t len) {
+    if (!on_link_thread) {
+        send_all(sock, buf, len);
+        return;
+    }
+    if (send_all_flags(sock, buf, len, MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        log_message("CLIENT TOO SLOW: sock=%d, disconnecting", sock);
+        shutdown(sock, SHUT_RDWR);
+    }
+}
+
+// Replies to the client whose line is being handled are prefixed with its
+// request id ("#<id> ", echoed from the request) and collected here, then
+// written with one send when the line is done
+#define REQ_ID_MAX 31
+
+typedef struct {
+    int sock;
+    char req_id[REQ_ID_MAX + 3];    // "#<id> " or ""
+    char buf[BUF_SIZE];
+    size_t len;
+    int forwarded;                  // lines cluster_route sent to another node
+} reply_ctx_t;
+
+static __thread reply_ctx_t *reply_ctx = NULL;
+
+static void reply_flush(reply_ctx_t *ctx) {
+    if (ctx->len == 0) return;
+    ctx->buf[ctx->len] = '\0';
+    if (is_remote_player(ctx->sock)) cluster_deliver(ctx->sock, ctx->buf);
+    else send_client(ctx->sock, ctx->buf, ctx->len);
+    ctx->len = 0;
+}
+
+static void reply_append(reply_ctx_t *ctx, const char *msg) {
+    size_t plen = strlen(ctx->req_id), mlen = strlen(msg);
+    if (ctx->len + plen + mlen >= sizeof(ctx->buf)) reply_flush(ctx);
+    if (plen + mlen >= sizeof(ctx->buf)) return;   // cannot happen for our replies
+    memcpy(ctx->buf + ctx->len, ctx->req_id, plen);
+    memcpy(ctx->buf + ctx->len + plen, msg, mlen);
+    ctx->len += plen + mlen;
+}
+
 // Send status to client
 void send_status(int client_sock, const char *msg) {
-    send_all(client_sock, msg, strlen(msg));
+    if (reply_ctx && reply_ctx->sock == client_sock) {
+        reply_append(reply_ctx, msg);
+        return;
+    }
+    if (is_remote_player(client_sock)) {
+        cluster_deliver(client_sock, msg);
+        return;
+    }
+    send_client(client_sock, msg, strlen(msg));
+}
+
+// Seqlock write side, caller holds matches_mutex
+static void match_write_begin(match_t *m) {
+    unsigned s = atomic_load_explicit(&m->seq, memory_order_relaxed);
+    atomic_store_explicit(&m->seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void match_write_end(match_t *m) {
+    unsigned s = atomic_load_explicit(&m->seq, memory_order_relaxed);
+    atomic_store_explicit(&m->seq, s + 1, memory_order_release);
 }
 
 static match_t *find_match_locked(int id) {
-    match_t *m = matches;
+    match_t *m = atomic_load_explicit(&matches, memory_order_relaxed);
     while (m) {
         if (m->id == id) return m;
-        m = m->next;
+        m = atomic_load_explicit(&m->next, memory_order_relaxed);
     }
     return NULL;
 }
 
-// create a new match and add to list
-static match_t *create_match_locked(int id) {
-    match_t *m = calloc(1, sizeof(match_t)); 
-    if (!m) return NULL; 
+// Take a match off the finished list, caller holds matches_mutex
+static void finished_unlink_locked(match_t *target) {
+    if (!target->finished_kept) return;
+    match_t *prev = NULL;
+    for (match_t *m = finished_head; m; prev = m, m = m->finished_next) {
+        if (m != target) continue;
+        if (prev) prev->finished_next = m->finished_next;
+        else finished_head = m->finished_next;
+        if (finished_tail == m) finished_tail = prev;
+        finished_count--;
+        break;
+    }
+    target->finished_kept = 0;
+}
+
+// Clear a match to an empty board, caller holds matches_mutex
+static void reset_match_locked(match_t *m, int id) {
+    finished_unlink_locked(m);
+    match_write_begin(m);
     m->id = id;
     m->players[0] = m->players[1] = 0; 
-    memset(m->board, 0, sizeof(m->board));
+    for (int i = 0; i < BOARD_N; i++)
+        for (int j = 0; j < BOARD_N; j++) m->board[i][j] = 0;
     m->turn = 0;
     m->is_finished = 0;
     m->winner = -1;
-    m->next = matches;
-    matches = m;
+    m->in_use = 1;
+    match_write_end(m);
+}
+
+// create a new match and add to list
+static match_t *create_match_locked(int id) {
+    match_t *m = free_matches;
+    if (m) free_matches = m->free_next;
+    else m = calloc(1, sizeof(match_t)); 
+    if (!m) return NULL; 
+
+    reset_match_locked(m, id);
+    atomic_store_explicit(&m->next, atomic_load_explicit(&matches, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&matches, m, memory_order_release);
     return m;
 }
 
+// Unlink a match and put it on the free list. Its next pointer is left
+// intact so a concurrent reader standing on it can keep walking.
+static void release_match_locked(match_t *target) {
+    finished_unlink_locked(target);
+    _Atomic(match_t *) *pp = &matches;
+    match_t *m;
+    while ((m = atomic_load_explicit(pp, memory_order_relaxed))) {
+        if (m == target) {
+            atomic_store_explicit(pp, atomic_load_explicit(&m->next, memory_order_relaxed), memory_order_release);
+            break;
+        }
+        pp = &m->next;
+    }
+
+    match_write_begin(target);
+    target->in_use = 0;
+    match_write_end(target);
+    target->players[0] = target->players[1] = 0;
+    target->free_next = free_matches;
+    free_matches = target;
+}
+
+// Keep a finished match for STATE, releasing the oldest beyond the limit
+static void finished_push_locked(match_t *m) {
+    if (m->finished_kept) return;
+    m->finished_kept = 1;
+    m->finished_next = NULL;
+    if (finished_tail) finished_tail->finished_next = m;
+    else finished_head = m;
+    finished_tail = m;
+    if (++finished_count > MAX_FINISHED_KEPT) release_match_locked(finished_head);
+}
+
+// Read a consistent copy of a match without taking matches_mutex.
+// Returns 1 if found, 0 otherwise.
+static int snapshot_match(int id, match_snapshot_t *out) {
+    match_t *m = atomic_load_explicit(&matches, memory_order_acquire);
+    while (m) {
+        int cur_id = 0, cur_in_use = 0;
+        unsigned s1, s2 = 0;
+        do {
+            s1 = atomic_load_explicit(&m->seq, memory_order_acquire);
+            if (s1 & 1) continue;
+            cur_id = atomic_load_explicit(&m->id, memory_order_relaxed);
+            cur_in_use = atomic_load_explicit(&m->in_use, memory_order_relaxed);
+            for (int i = 0; i < BOARD_N; i++)
+                for (int j = 0; j < BOARD_N; j++)
+                    out->board[i][j] = atomic_load_explicit(&m->board[i][j], memory_order_relaxed);
+            out->turn = atomic_load_explicit(&m->turn, memory_order_relaxed);
+            out->is_finished = atomic_load_explicit(&m->is_finished, memory_order_relaxed);
+            out->winner = atomic_load_explicit(&m->winner, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            s2 = atomic_load_explicit(&m->seq, memory_order_relaxed);
+        } while ((s1 & 1) || s1 != s2);
+
+        if (cur_in_use && cur_id == id) return 1;
+        m = atomic_load_explicit(&m->next, memory_order_acquire);
+    }
+    return 0;
+}
+
 // assign client socket to a match
 static int assign_player_to_match(int id, int sock) {
+    TRACE_BEGIN("matches_mutex wait");
     pthread_mutex_lock(&matches_mutex);
+    TRACE_END("matches_mutex wait");
     match_t *m = find_match_locked(id);
     if (!m) m = create_match_locked(id);
+    else if (m->is_finished) reset_match_locked(m, id);
     if (!m) { pthread_mutex_unlock(&matches_mutex); return -2; }
 
     if (m->players[0] == sock) { pthread_mutex_unlock(&matches_mutex); return 0; }
@@ -190,18 +575,14 @@ static int assign_player_to_match(int id, int sock) {
 
 static void remove_player_from_matches(int sock) {
     pthread_mutex_lock(&matches_mutex);
-    match_t **pp = &matches;
-    while (*pp) {
-        match_t *m = *pp;
+    match_t *m = atomic_load_explicit(&matches, memory_order_relaxed);
+    while (m) {
+        match_t *next = atomic_load_explicit(&m->next, memory_order_relaxed);
         if (m->players[0] == sock) m->players[0] = 0;
         if (m->players[1] == sock) m->players[1] = 0;
 
-        if (m->players[0] == 0 && m->players[1] == 0) {
-            *pp = m->next;
-            free(m);
-            continue;
-        }
-        pp = &m->next;
+        if (m->players[0] == 0 && m->players[1] == 0) release_match_locked(m);
+        m = next;
     }
     pthread_mutex_unlock(&matches_mutex);
 }
@@ -248,10 +629,12 @@ static int check_win(match_t *m, int player_idx) {
 // Process MOVE command
 static int process_move(int client_sock, int match_id, int r, int c) { 
     char buf[256]; 
+    TRACE_BEGIN("matches_mutex wait");
     pthread_mutex_lock(&matches_mutex); 
+    TRACE_END("matches_mutex wait");
 
     match_t *m = find_match_locked(match_id); 
-    if (!m) { 
+    if (!m || m->is_finished) { 
         pthread_mutex_unlock(&matches_mutex); 
         send_status(client_sock, "240 MOVE_FAIL not_in_match\r\n"); 
         return -1;
@@ -289,15 +672,20 @@ static int process_move(int client_sock, int match_id, int r, int c) {
     }
 
     // Make the move
+    match_write_begin(m);
     m->board[r][c] = idx + 1;
     int opponent = m->players[1 - idx];
     int is_win = check_win(m, idx); 
     m->turn = 1 - m->turn; 
-    log_message("MOVE OK: player %d at row=%d col=%d (match_id=%d, sock=%d)", idx, r, c, match_id, client_sock);
-    
     if (is_win) {
         m->is_finished = 1; 
         m->winner = idx; 
+    }
+    match_write_end(m);
+    if (is_win) finished_push_locked(m);
+
+    log_message("MOVE OK: player %d at row=%d col=%d (match_id=%d, sock=%d)", idx, r, c, match_id, client_sock);
+    if (is_win) {
         log_message("MATCH RESULT: player %d wins (match_id=%d)", idx, match_id);
     }
 
@@ -319,28 +707,17 @@ static int process_move(int client_sock, int match_id, int r, int c) {
         if (opponent != 0) {
             send_status(opponent, loser_msg);
         }
-        // Remove match from list
-        pthread_mutex_lock(&matches_mutex); 
-        match_t **pp = &matches; 
-        while (*pp) { 
-            if ((*pp)->id == match_id) { 
-                match_t *tmp = *pp; 
-                *pp = tmp->next; 
-                free(tmp); 
-                break;
-            }
-            pp = &(*pp)->next; 
-        }
-        pthread_mutex_unlock(&matches_mutex);
     }
     return 1;
 }
 
 // Process STOP command
 static int process_stop(int client_sock, int match_id) {
+    TRACE_BEGIN("matches_mutex wait");
     pthread_mutex_lock(&matches_mutex);
+    TRACE_END("matches_mutex wait");
     match_t *m = find_match_locked(match_id);
-    if (!m) {
+    if (!m || m->is_finished) {
         pthread_mutex_unlock(&matches_mutex);
         log_message("STOP FAIL: match not found (match_id=%d)", match_id);
         send_status(client_sock, "360 STOP_FAIL match_not_found\r\n");
@@ -361,18 +738,9 @@ static int process_stop(int client_sock, int match_id) {
     int opponent = m->players[1 - idx];
     
     // Remove match from list
-    match_t **pp = &matches;
-    while (*pp) {
-        if ((*pp)->id == match_id) {
-            match_t *tmp = *pp;
-            *pp = tmp->next;
-            log_message("STOP OK: match stopped (match_id=%d, initiator_idx=%d)", match_id, idx);
-            free(tmp);
-            break;
-        }
-        pp = &(*pp)->next;
-    }
+    release_match_locked(m);
     pthread_mutex_unlock(&matches_mutex);
+    log_message("STOP OK: match stopped (match_id=%d, initiator_idx=%d)", match_id, idx);
     
     send_status(client_sock, "170 STOP_OK\r\n");
     if (opponent != 0) {
@@ -383,20 +751,104 @@ static int process_stop(int client_sock, int match_id) {
     return 1;
 }
 
-// Handle a single line from client
-void handle_line(int client_sock, const char *line) {
+// Process STATE command, never blocks MOVE/STOP writers
+static int process_state(int client_sock, int match_id) {
+    match_snapshot_t snap;
+    if (!snapshot_match(match_id, &snap)) {
+        send_status(client_sock, STR_STATE_FAIL_NOT_FOUND);
+        return -1;
+    }
+
+    char board[BOARD_N * BOARD_N + 1];
+    for (int i = 0; i < BOARD_N; i++)
+        for (int j = 0; j < BOARD_N; j++)
+            board[i * BOARD_N + j] = '0' + snap.board[i][j];
+    board[BOARD_N * BOARD_N] = '\0';
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "180 STATE match %d board %s turn %d finished %d winner %d\r\n",
+             match_id, board, snap.turn, snap.is_finished, snap.winner);
+    send_status(client_sock, buf);
+    return 1;
+}
+
+#ifdef TRACE_ENABLED
+#define TRACE_DUMP_INTERVAL_US 1000000   // at most one TRACE DUMP per second
+
+// TRACE is an operator command: only clients on the loopback interface,
+// never players forwarded from another node
+static int is_local_client(int client_sock) {
+    if (is_remote_player(client_sock)) return 0;
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(client_sock, (struct sockaddr*)&peer, &len) < 0 || peer.sin_family != AF_INET) return 0;
+    return (ntohl(peer.sin_addr.s_addr) >> 24) == 127;
+}
+
+static atomic_ullong trace_last_dump_us = 0;
+#endif
+
+// Process TRACE command
+static void process_trace(int client_sock, const char *line) {
+#ifdef TRACE_ENABLED
+    if (!is_local_client(client_sock)) {
+        send_status(client_sock, STR_TRACE_FAIL_DENIED);
+        return;
+    }
+    char arg[16];
+    if (sscanf(line, "TRACE %15s", arg) != 1) {
+        send_status(client_sock, STR_TRACE_FAIL_FORMAT);
+        return;
+    }
+    if (strcmp(arg, "ON") == 0 || strcmp(arg, "OFF") == 0) {
+        trace_set_enabled(strcmp(arg, "ON") == 0);
+        log_message("TRACE %s (sock=%d)", arg, client_sock);
+        send_status(client_sock, STR_TRACE_OK);
+        return;
+    }
+    if (strcmp(arg, "DUMP") == 0) {
+        char path[64], buf[128];
+        unsigned long long now = now_us();
+        unsigned long long last = atomic_load(&trace_last_dump_us);
+        if ((last != 0 && now - last < TRACE_DUMP_INTERVAL_US) ||
+            !atomic_compare_exchange_strong(&trace_last_dump_us, &last, now)) {
+            send_status(client_sock, STR_TRACE_FAIL_BUSY);
+            return;
+        }
+        if (trace_dump_next(path, sizeof(path)) < 0) {
+            send_status(client_sock, STR_TRACE_FAIL_DUMP);
+            return;
+        }
+        log_message("TRACE DUMP: %s (sock=%d)", path, client_sock);
+        snprintf(buf, sizeof(buf), "190 TRACE_OK %s\r\n", path);
+        send_status(client_sock, buf);
+        return;
+    }
+    send_status(client_sock, STR_TRACE_FAIL_FORMAT);
+#else
+    (void)line;
+    send_status(client_sock, STR_TRACE_FAIL_DISABLED);
+#endif
+}
+
+// Run one command. raw is the command as received, request id included,
+// and is what gets forwarded when another cluster node owns the match.
+static void dispatch_line(int client_sock, const char *line, const char *raw) {
     // MOVE command
     if (strncmp(line, "MOVE", 4) == 0) {
         int match_id, r, c;
         if (sscanf(line, "MOVE match %d row %d col %d",
                    &match_id, &r, &c) == 3) {
+            if (cluster_route(client_sock, match_id, raw)) return;
 
             int assigned = assign_player_to_match(match_id, client_sock);
             if (assigned < -1) {
                 send_status(client_sock, STR_SERVER_ERROR);
                 return;
             }
+            TRACE_BEGIN("process_move");
             process_move(client_sock, match_id, r, c);
+            TRACE_END("process_move");
             return;
         } else {
             send_status(client_sock, "244 MOVE_FAIL format_error\r\n");
@@ -408,7 +860,10 @@ void handle_line(int client_sock, const char *line) {
     if (strncmp(line, "STOP", 4) == 0) {
         int match_id;
         if (sscanf(line, "STOP match %d", &match_id) == 1) {
+            if (cluster_route(client_sock, match_id, raw)) return;
+            TRACE_BEGIN("process_stop");
             process_stop(client_sock, match_id);
+            TRACE_END("process_stop");
             return;
         } else {
             send_status(client_sock, "360 STOP_FAIL format_error\r\n");
@@ -416,6 +871,24 @@ void handle_line(int client_sock, const char *line) {
         }
     }
 
+    // STATE command
+    if (strncmp(line, "STATE", 5) == 0) {
+        int match_id;
+        if (sscanf(line, "STATE match %d", &match_id) == 1) {
+            if (cluster_route(client_sock, match_id, raw)) return;
+            process_state(client_sock, match_id);
+        } else {
+            send_status(client_sock, STR_STATE_FAIL_FORMAT);
+        }
+        return;
+    }
+
+    // TRACE ON|OFF|DUMP
+    if (strncmp(line, "TRACE", 5) == 0) {
+        process_trace(client_sock, line);
+        return;
+    }
+
     // REGISTER / LOGIN / LOGOUT
     char cmd[16], u[128], p[128];
     if (sscanf(line, "%15s %127s %127s", cmd, u, p) < 1) {
@@ -461,43 +934,1395 @@ void handle_line(int client_sock, const char *line) {
     send_status(client_sock, STR_SERVER_ERROR);
 }
 
+// Split an optional "#<id> " off the front of line. Stores the reply
+// prefix in req_id and returns the command, or NULL if the id is malformed.
+static const char *parse_request_id(const char *line, char *req_id) {
+    req_id[0] = '\0';
+    if (line[0] != '#') return line;
+    size_t n = strcspn(line + 1, " ");
+    if (n == 0 || n > REQ_ID_MAX || line[1 + n] != ' ') return NULL;
+    memcpy(req_id, line, n + 1);
+    req_id[n + 1] = ' ';
+    req_id[n + 2] = '\0';
+    const char *cmd = line + n + 2;
+    while (*cmd == ' ') cmd++;
+    return cmd;
+}
+
+// Process MULTI: "MULTI [#id] <op>; [#id] <op>; ..." with MOVE/STOP/STATE
+// ops, possibly across matches. Every reply to this client, plus the final
+// 155 MULTI_OK, goes out in one write. Ops forwarded to another cluster
+// node are answered by that node separately and may arrive after
+// MULTI_OK, so they are not in its count but reported as
+// "155 MULTI_OK count <answered> pending <forwarded>".
+// Like any line, a MULTI is at most BUF_SIZE-1 bytes including CRLF, about
+// 150 "MOVE match <id> row <r> col <c>" ops; a longer one gets
+// 245 MULTI_FAIL too_long and none of its ops run.
+static void process_multi(reply_ctx_t *ctx, const char *ops) {
+    char copy[BUF_SIZE];
+    char multi_id[sizeof(ctx->req_id)];
+    strncpy(copy, ops, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    strcpy(multi_id, ctx->req_id);
+
+    int count = 0;
+    ctx->forwarded = 0;
+    for (char *save = NULL, *op = strtok_r(copy, ";", &save); op; op = strtok_r(NULL, ";", &save)) {
+        while (*op == ' ') op++;
+        size_t n = strlen(op);
+        while (n > 0 && op[n-1] == ' ') op[--n] = '\0';
+        if (n == 0) continue;
+        count++;
+
+        const char *cmd = parse_request_id(op, ctx->req_id);
+        if (!cmd) {
+            send_status(ctx->sock, STR_SERVER_ERROR);
+        } else if (strncmp(cmd, "MOVE", 4) == 0 || strncmp(cmd, "STOP", 4) == 0 ||
+                   strncmp(cmd, "STATE", 5) == 0) {
+            dispatch_line(ctx->sock, cmd, op);
+        } else {
+            send_status(ctx->sock, STR_MULTI_FAIL_UNSUPPORTED);
+        }
+    }
+
+    strcpy(ctx->req_id, multi_id);
+    if (count == 0) {
+        send_status(ctx->sock, STR_MULTI_FAIL_EMPTY);
+        return;
+    }
+    char buf[64];
+    if (ctx->forwarded > 0)
+        snprintf(buf, sizeof(buf), "155 MULTI_OK count %d pending %d\r\n",
+                 count - ctx->forwarded, ctx->forwarded);
+    else
+        snprintf(buf, sizeof(buf), "155 MULTI_OK count %d\r\n", count);
+    send_status(ctx->sock, buf);
+}
+
+// Handle a single line from client
+void handle_line(int client_sock, const char *line) {
+    reply_ctx_t ctx;
+    ctx.sock = client_sock;
+    ctx.len = 0;
+    ctx.forwarded = 0;
+    reply_ctx_t *outer = reply_ctx;
+    reply_ctx = &ctx;
+
+    const char *cmd = parse_request_id(line, ctx.req_id);
+    if (!cmd) {
+        send_status(client_sock, STR_SERVER_ERROR);
+    } else if (strncmp(cmd, "MULTI", 5) == 0 && (cmd[5] == ' ' || cmd[5] == '\0')) {
+        TRACE_BEGIN("process_multi");
+        process_multi(&ctx, cmd + 5);
+        TRACE_END("process_multi");
+    } else {
+        dispatch_line(client_sock, cmd, line);
+    }
+
+    reply_flush(&ctx);
+    reply_ctx = outer;
+}
+
+// Answer a line that did not fit in linebuf, given the part that did
+static void reject_long_line(int client_sock, const char *line) {
+    char req_id[REQ_ID_MAX + 3], msg[64];
+    const char *cmd = parse_request_id(line, req_id);
+    if (!cmd) req_id[0] = '\0';
+    int multi = cmd && strncmp(cmd, "MULTI", 5) == 0 && (cmd[5] == ' ' || cmd[5] == '\0');
+    snprintf(msg, sizeof(msg), "%s%s", req_id, multi ? STR_MULTI_FAIL_TOO_LONG : STR_SERVER_ERROR);
+    log_message("LINE TOO LONG: sock=%d", client_sock);
+    send_status(client_sock, msg);
+}
+
+
+// Cluster mode
+#define CLUSTER_MAX_NODES 16
+#define CLUSTER_VNODES 64
+#define CLUSTER_BIND_RETRY_US 100000
+#define CLUSTER_CONNECT_RETRY_US 200000
+#define CLUSTER_HELLO_TIMEOUT 1         // seconds for a new link to say HELLO
+#define CLUSTER_MAX_BYES MAX_SESSIONS
+
+typedef struct {
+    uint32_t point;
+    int node;
+} ring_point_t;
+
+typedef struct {
+    int fd;
+    char buf[BUF_SIZE];
+    size_t start;
+    size_t end;
+} link_reader_t;
+
+// One direction of a link between two nodes. Writers hold mutex and
+// never wait for a link to come up; the reader thread owns rd, and for
+// out links is the only one that connects. rd lives here rather than on
+// the thread stack so unread frames survive a hot restart.
+typedef struct {
+    int fd;
+    pthread_mutex_t mutex;
+    int byes[CLUSTER_MAX_BYES];   // out links: BYE ids held while the link is down
+    int n_byes;
+    link_reader_t rd;
+    pthread_t thread;             // sessions_mutex, like running and parked
+    int running;
+    int parked;                   // reader stopped for handoff, fd left open
+    int replaced;                 // in links: the node reconnected, keep its seats
+} cluster_link_t;
+
+
+static int cluster_nodes = 0;        // 0 when cluster mode is off
+static int cluster_self = -1;
+static char node_hosts[CLUSTER_MAX_NODES][64];
+static int node_ports[CLUSTER_MAX_NODES];
+static ring_point_t ring[CLUSTER_MAX_NODES * CLUSTER_VNODES];
+static int ring_len = 0;
+static cluster_link_t out_links[CLUSTER_MAX_NODES];   // we forward, they own
+static cluster_link_t in_links[CLUSTER_MAX_NODES];    // they forward, we own
+static uint32_t cluster_epoch = 0;                    // ours, kept across hot restarts
+static int cluster_listen_fd = -1;
+static pthread_t cluster_listener;
+static int cluster_listener_parked = 0;               // sessions_mutex
+static uint32_t node_epochs[CLUSTER_MAX_NODES];       // in_links[n].mutex, theirs as last seen
+
+static uint32_t fnv1a(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+// murmur3 finalizer, spreads sequential match ids over the ring
+static uint32_t mix32(uint32_t h) {
+    h ^= h >> 16; h *= 0x85ebca6bu;
+    h ^= h >> 13; h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int ring_cmp(const void *a, const void *b) {
+    uint32_t x = ((const ring_point_t *)a)->point, y = ((const ring_point_t *)b)->point;
+    return x < y ? -1 : x > y;
+}
+
+// Ring points are hashed from node addresses, not indexes, so adding a
+// node only takes over the arcs its own points land on
+static void build_ring(void) {
+    ring_len = 0;
+    for (int n = 0; n < cluster_nodes; n++) {
+        for (int v = 0; v < CLUSTER_VNODES; v++) {
+            char key[96];
+            snprintf(key, sizeof(key), "%s:%d#%d", node_hosts[n], node_ports[n], v);
+            ring[ring_len].point = fnv1a(key);
+            ring[ring_len].node = n;
+            ring_len++;
+        }
+    }
+    qsort(ring, ring_len, sizeof(ring[0]), ring_cmp);
+}
+
+// Identifies the first n_nodes of the node list and our place in it, 0
+// outside cluster mode. A successor may only append nodes, see takeover_from.
+static uint32_t cluster_membership(int n_nodes) {
+    if (cluster_nodes == 0) return 0;
+    char key[CLUSTER_MAX_NODES * 72 + 16];
+    int len = snprintf(key, sizeof(key), "%d/", cluster_self);
+    for (int n = 0; n < n_nodes; n++)
+        len += snprintf(key + len, sizeof(key) - len, "%s:%d,", node_hosts[n], node_ports[n]);
+    return fnv1a(key) | 1;
+}
+
+static int match_owner(int match_id) {
+    uint32_t h = mix32((uint32_t)match_id);
+    int lo = 0, hi = ring_len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].point < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return ring[lo == ring_len ? 0 : lo].node;
+}
+
+// Parse "host:port,host:port,..." into node_hosts/node_ports. Hosts must
+// be IPv4 addresses: links are bound to them and checked against them.
+static int parse_cluster(const char *spec) {
+    char copy[1024];
+    strncpy(copy, spec, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    cluster_nodes = 0;
+    for (char *save = NULL, *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(tok, ':');
+        if (!colon || cluster_nodes == CLUSTER_MAX_NODES) return -1;
+        *colon = '\0';
+        struct in_addr ia;
+        if (inet_pton(AF_INET, tok, &ia) != 1) return -1;
+        strncpy(node_hosts[cluster_nodes], tok, sizeof(node_hosts[0]) - 1);
+        node_ports[cluster_nodes] = atoi(colon + 1);
+        cluster_nodes++;
+    }
+    return cluster_nodes > 0 ? 0 : -1;
+}
+
+// Read one header line. Returns -2, consuming nothing, if a handoff
+// interrupts the wait, so the caller can park with the buffer intact.
+static int link_read_line(link_reader_t *r, char *out, size_t out_size) {
+    while (1) {
+        char *nl = memchr(r->buf + r->start, '\n', r->end - r->start);
+        if (nl) {
+            size_t len = nl - (r->buf + r->start);
+            if (len >= out_size) return -1;
+            memcpy(out, r->buf + r->start, len);
+            out[len] = '\0';
+            r->start += len + 1;
+            return 0;
+        }
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        if (r->end == sizeof(r->buf)) return -1;
+        ssize_t n = recv(r->fd, r->buf + r->end, sizeof(r->buf) - r->end, 0);
+        if (n < 0 && errno == EINTR) {
+            if (atomic_load(&draining)) return -2;
+            continue;
+        }
+        if (n <= 0) return -1;
+        r->end += n;
+    }
+}
+
+static int link_read_n(link_reader_t *r, char *out, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        if (r->start == r->end) {
+            r->start = r->end = 0;
+            ssize_t n = recv(r->fd, r->buf, sizeof(r->buf), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            r->end = n;
+        }
+        size_t take = r->end - r->start;
+        if (take > len - got) take = len - got;
+        memcpy(out + got, r->buf + r->start, take);
+        r->start += take;
+        got += take;
+    }
+    return 0;
+}
+
+// Write "<header>\n<payload>" as one frame on a link
+static int link_send_frame(cluster_link_t *link, const char *header, const char *payload, size_t len) {
+    char frame[BUF_SIZE + 64];
+    int hlen = snprintf(frame, sizeof(frame), "%s\n", header);
+    if (hlen < 0 || (size_t)hlen + len > sizeof(frame)) return -1;
+    memcpy(frame + hlen, payload, len);
+    if (link->fd < 0) return -1;
+    return send_all(link->fd, frame, hlen + len) == (ssize_t)(hlen + len) ? 0 : -1;
+}
+
+// Owner side: relay a message to a player connected on another node
+static int cluster_deliver(int player, const char *msg) {
+    int node = remote_node(player);
+    if (node < 0 || node >= cluster_nodes) return -1;
+    cluster_link_t *link = &in_links[node];
+    size_t len = strlen(msg);
+    char header[64];
+    snprintf(header, sizeof(header), "DLV %d %zu", remote_session(player), len);
+    pthread_mutex_lock(&link->mutex);
+    int r = link_send_frame(link, header, msg, len);
+    pthread_mutex_unlock(&link->mutex);
+    return r;
+}
+
+// Origin side: find the live session with this id and keep its socket
+// open until session_unpin. Returns the socket, or -1 if it is gone.
+static int session_pin(int id, session_t **out) {
+    if (id <= 0) return -1;
+    session_t *sess = &sessions[id & (MAX_SESSIONS - 1)];
+    int sock = -1;
+    pthread_mutex_lock(&sessions_mutex);
+    if (sess->active && sess->id == id) {
+        sess->pins++;
+        sock = sess->sock;
+        *out = sess;
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+    return sock;
+}
+
+static void session_unpin(session_t *sess) {
+    pthread_mutex_lock(&sessions_mutex);
+    if (--sess->pins == 0) pthread_cond_broadcast(&sessions_cond);
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+// Report this thread parked and block until a failed handoff resumes.
+// A successful one ends the process here.
+static void park_while_draining(int *parked) {
+    pthread_mutex_lock(&sessions_mutex);
+    *parked = 1;
+    pthread_cond_broadcast(&sessions_cond);
+    while (atomic_load(&draining)) pthread_cond_wait(&sessions_cond, &sessions_mutex);
+    *parked = 0;
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+// Connect to the owner node and send HELLO. The source address is our own
+// listed host, which the owner checks.
+static int connect_out_link(int node) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in self = {0}, addr = {0};
+    self.sin_family = AF_INET;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(node_ports[node]);
+    if (inet_pton(AF_INET, node_hosts[cluster_self], &self.sin_addr) != 1 ||
+        inet_pton(AF_INET, node_hosts[node], &addr.sin_addr) != 1 ||
+        bind(fd, (struct sockaddr*)&self, sizeof(self)) < 0 ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    char hello[48];
+    int n = snprintf(hello, sizeof(hello), "HELLO %d %u\n", cluster_self, cluster_epoch);
+    if (send_all(fd, hello, n) != n) { close(fd); return -1; }
+    return fd;
+}
+
+// Origin side: keep the link to one owner up and pass its DLV frames to
+// local clients. Only this thread connects, so a node that is down or
+// unreachable never holds up a client thread. A link adopted in a hot
+// restart starts out connected, with whatever the old process had read.
+static void *out_link_thread(void *arg) {
+    int node = (int)(intptr_t)arg;
+    cluster_link_t *link = &out_links[node];
+    link_reader_t *rd = &link->rd;
+    char header[128], payload[BUF_SIZE];
+    int up = 0;   // link published, BYEs and matches sent; an adopted link starts here too
+    on_link_thread = 1;
+
+    while (1) {
+        if (atomic_load(&draining)) { park_while_draining(&link->parked); continue; }
+        if (rd->fd < 0) {
+            rd->fd = connect_out_link(node);
+            if (rd->fd < 0) { usleep(CLUSTER_CONNECT_RETRY_US); continue; }
+            rd->start = rd->end = 0;
+        }
+        if (!up) {
+            // Clients that left while the link was down may still hold seats there
+            pthread_mutex_lock(&link->mutex);
+            link->fd = rd->fd;
+            for (int i = 0; i < link->n_byes; i++) {
+                char bye[32];
+                snprintf(bye, sizeof(bye), "BYE %d", link->byes[i]);
+                if (link_send_frame(link, bye, "", 0) < 0) break;
+            }
+            link->n_byes = 0;
+            cluster_migrate_to(node);
+            pthread_mutex_unlock(&link->mutex);
+            log_message("CLUSTER LINK UP: node %d (%s:%d)", node, node_hosts[node], node_ports[node]);
+            up = 1;
+        }
+
+        int r = link_read_line(rd, header, sizeof(header));
+        if (r == -2) continue;
+        int id;
+        size_t len;
+        if (r == 0 && sscanf(header, "DLV %d %zu", &id, &len) == 2 && len <= sizeof(payload) &&
+            link_read_n(rd, payload, len) == 0) {
+            session_t *sess;
+            int sock = session_pin(id, &sess);
+            if (sock < 0) continue;   // client left, drop the reply
+            send_client(sock, payload, len);
+            session_unpin(sess);
+            continue;
+        }
+
+        pthread_mutex_lock(&link->mutex);
+        link->fd = -1;
+        pthread_mutex_unlock(&link->mutex);
+        close(rd->fd);
+        rd->fd = -1;
+        up = 0;
+        log_message("CLUSTER LINK DOWN: node %d", node);
+        usleep(CLUSTER_CONNECT_RETRY_US);   // a node still on a shorter list refuses us
+    }
+    return NULL;
+}
+
+// Forward a command for a match owned elsewhere. Returns 1 when the line
+// was handled here (forwarded, or failed with a reply), 0 to run locally.
+static int cluster_route(int client_sock, int match_id, const char *line) {
+    if (cluster_nodes == 0) return 0;
+    int owner = match_owner(match_id);
+    if (owner == cluster_self) return 0;
+    if (is_remote_player(client_sock)) {
+        // Sent by a node still on the shorter list, for a match moved away
+        log_message("CLUSTER MISROUTED: match_id=%d belongs to node %d", match_id, owner);
+        send_status(client_sock, STR_SERVER_ERROR);
+        return 1;
+    }
+
+    cluster_link_t *link = &out_links[owner];
+    size_t len = strlen(line);
+    char header[64];
+    snprintf(header, sizeof(header), "FWD %d %zu", current_session_id, len);
+    pthread_mutex_lock(&link->mutex);
+    int r = link_send_frame(link, header, line, len);   // fails fast while the link is down
+    pthread_mutex_unlock(&link->mutex);
+
+    if (r < 0) {
+        log_message("CLUSTER FORWARD FAIL: node %d (match_id=%d, sock=%d)", owner, match_id, client_sock);
+        send_status(client_sock, STR_SERVER_ERROR);
+    } else if (reply_ctx && reply_ctx->sock == client_sock) {
+        reply_ctx->forwarded++;
+    }
+    return 1;
+}
+
+// Tell every owner node that a local client is gone. While a link is down
+// the BYE is held for out_link_thread to send on reconnect: the owner may
+// still hold seats for us from before a hot restart.
+static void cluster_client_gone(int session_id) {
+    if (cluster_nodes == 0) return;
+    char header[32];
+    snprintf(header, sizeof(header), "BYE %d", session_id);
+    for (int n = 0; n < cluster_nodes; n++) {
+        if (n == cluster_self) continue;
+        cluster_link_t *link = &out_links[n];
+        pthread_mutex_lock(&link->mutex);
+        if (link_send_frame(link, header, "", 0) < 0) {
+            if (link->n_byes < CLUSTER_MAX_BYES) link->byes[link->n_byes++] = session_id;
+            else log_message("CLUSTER BYE DROPPED: node %d, session %d", n, session_id);
+        }
+        pthread_mutex_unlock(&link->mutex);
+    }
+}
+
+// Owner side: drop every seat held by clients of one origin node
+static void remove_node_players(int node) {
+    pthread_mutex_lock(&matches_mutex);
+    match_t *m = atomic_load_explicit(&matches, memory_order_relaxed);
+    while (m) {
+        match_t *next = atomic_load_explicit(&m->next, memory_order_relaxed);
+        for (int p = 0; p < 2; p++)
+            if (is_remote_player(m->players[p]) && remote_node(m->players[p]) == node) m->players[p] = 0;
+        if (m->players[0] == 0 && m->players[1] == 0) release_match_locked(m);
+        m = next;
+    }
+    pthread_mutex_unlock(&matches_mutex);
+}
+
+// Check that a link really comes from the listed host of node
+static int link_peer_is(int fd, int node) {
+    struct sockaddr_in peer, want;
+    socklen_t len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr*)&peer, &len) < 0 || peer.sin_family != AF_INET) return 0;
+    if (inet_pton(AF_INET, node_hosts[node], &want.sin_addr) != 1) return 0;
+    return peer.sin_addr.s_addr == want.sin_addr.s_addr;
+}
+
+// Owner side: run commands forwarded by one origin node. The listener has
+// already read HELLO into in_links[node].rd.
+static void *in_link_thread(void *arg) {
+    int node = (int)(intptr_t)arg;
+    cluster_link_t *link = &in_links[node];
+    link_reader_t *rd = &link->rd;
+    char header[128], line[BUF_SIZE];
+    on_link_thread = 1;
+
+    while (1) {
+        if (atomic_load(&draining)) { park_while_draining(&link->parked); continue; }
+        int r = link_read_line(rd, header, sizeof(header));
+        if (r == -2) continue;
+        if (r < 0) break;
+        int id;
+        unsigned epoch;
+        size_t len;
+        if (sscanf(header, "FWD %d %zu", &id, &len) == 2) {
+            if (len >= sizeof(line) || link_read_n(rd, line, len) < 0) break;
+            line[len] = '\0';
+            handle_line(remote_player(node, id & REMOTE_SESSION_MASK), line);
+        } else if (sscanf(header, "BYE %d", &id) == 1) {
+            remove_player_from_matches(remote_player(node, id & REMOTE_SESSION_MASK));
+        } else if (sscanf(header, "MIG %zu", &len) == 1) {
+            if (len > sizeof(line) || link_read_n(rd, line, len) < 0) break;
+            cluster_adopt_match(node, line, len);
+        } else if (sscanf(header, "EPOCH %d %u", &id, &epoch) == 2) {
+            // Sent ahead of MIG frames; our own view of a node wins
+            if (id < 0 || id >= cluster_nodes || id == cluster_self) continue;
+            pthread_mutex_lock(&in_links[id].mutex);
+            if (node_epochs[id] == 0) node_epochs[id] = epoch;
+            pthread_mutex_unlock(&in_links[id].mutex);
+        } else {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&link->mutex);
+    link->fd = -1;
+    pthread_mutex_unlock(&link->mutex);
+    close(rd->fd);
+    pthread_mutex_lock(&sessions_mutex);
+    int replaced = link->replaced;
+    pthread_mutex_unlock(&sessions_mutex);
+    if (!replaced) {
+        log_message("CLUSTER LINK LOST: node %d, dropping its players", node);
+        remove_node_players(node);
+    }
+
+    pthread_mutex_lock(&sessions_mutex);
+    rd->fd = -1;
+    link->running = 0;
+    pthread_cond_broadcast(&sessions_cond);
+    pthread_mutex_unlock(&sessions_mutex);
+    return NULL;
+}
+
+// Start the reader for an in link whose rd is filled in
+static int start_in_link_locked(int node) {
+    cluster_link_t *link = &in_links[node];
+    pthread_mutex_lock(&link->mutex);
+    link->fd = link->rd.fd;
+    pthread_mutex_unlock(&link->mutex);
+    link->running = 1;
+    link->parked = 0;
+    link->replaced = 0;
+    if (pthread_create(&link->thread, NULL, in_link_thread, (void *)(intptr_t)node) != 0) {
+        pthread_mutex_lock(&link->mutex);
+        link->fd = -1;
+        pthread_mutex_unlock(&link->mutex);
+        link->running = 0;
+        return -1;
+    }
+    pthread_detach(link->thread);
+    return 0;
+}
+
+// Read and check HELLO on a new link, then hand it to an in_link_thread.
+// A reconnect replaces the node's previous link, whose thread is waited
+// out so each node has one reader.
+static void accept_in_link(int fd) {
+    link_reader_t rd = { .fd = fd, .start = 0, .end = 0 };
+    char header[128] = "";
+    struct timeval tv = { CLUSTER_HELLO_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int r;
+    while ((r = link_read_line(&rd, header, sizeof(header))) == -2) {}
+
+    int node;
+    unsigned epoch;
+    if (r < 0 || sscanf(header, "HELLO %d %u", &node, &epoch) != 2 || node < 0 || node >= cluster_nodes ||
+        node == cluster_self || !link_peer_is(fd, node)) {
+        log_message("CLUSTER LINK REJECTED: %s", header);
+        close(fd);
+        return;
+    }
+    tv.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    cluster_link_t *link = &in_links[node];
+    pthread_mutex_lock(&sessions_mutex);
+    while (link->running) {
+        link->replaced = 1;
+        pthread_mutex_lock(&link->mutex);
+        if (link->fd >= 0) shutdown(link->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&link->mutex);
+        pthread_cond_wait(&sessions_cond, &sessions_mutex);
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+
+    // A new epoch means the origin restarted from scratch, so the session
+    // ids our seats refer to are meaningless now
+    pthread_mutex_lock(&link->mutex);
+    int restarted = node_epochs[node] != epoch;
+    node_epochs[node] = epoch;
+    pthread_mutex_unlock(&link->mutex);
+    if (restarted) remove_node_players(node);
+
+    pthread_mutex_lock(&sessions_mutex);
+    link->rd = rd;
+    if (start_in_link_locked(node) < 0) {
+        link->rd.fd = -1;
+        close(fd);
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+// Accept links from other nodes. Without an adopted socket, keep retrying
+// the bind in case another process still holds the port for a moment.
+static void *cluster_listen_thread(void *arg) {
+    (void)arg;
+    if (cluster_listen_fd < 0) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) { perror("socket"); return NULL; }
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(node_ports[cluster_self]);
+        inet_pton(AF_INET, node_hosts[cluster_self], &addr.sin_addr);   // checked by parse_cluster
+        while (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) usleep(CLUSTER_BIND_RETRY_US);
+        if (listen(fd, BACKLOG) < 0) { perror("listen"); close(fd); return NULL; }
+        pthread_mutex_lock(&sessions_mutex);
+        cluster_listen_fd = fd;
+        pthread_mutex_unlock(&sessions_mutex);
+    }
+    log_message("CLUSTER LISTENING: node %d of %d on port %d", cluster_self, cluster_nodes, node_ports[cluster_self]);
+
+    while (1) {
+        if (atomic_load(&draining)) { park_while_draining(&cluster_listener_parked); continue; }
+        int link_fd = accept(cluster_listen_fd, NULL, NULL);
+        if (link_fd < 0) continue;
+        accept_in_link(link_fd);
+    }
+    return NULL;
+}
+
+static int start_cluster(const char *spec, int self) {
+    if (parse_cluster(spec) < 0 || self < 0 || self >= cluster_nodes) {
+        cluster_nodes = 0;
+        return -1;
+    }
+    cluster_self = self;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cluster_epoch = ((uint32_t)ts.tv_nsec ^ (uint32_t)ts.tv_sec << 8 ^ (uint32_t)getpid()) | 1;
+    for (int n = 0; n < cluster_nodes; n++) {
+        out_links[n].fd = in_links[n].fd = -1;
+        out_links[n].rd.fd = in_links[n].rd.fd = -1;
+        pthread_mutex_init(&out_links[n].mutex, NULL);
+        pthread_mutex_init(&in_links[n].mutex, NULL);
+    }
+    build_ring();
+    return 0;
+}
+
+// Start the link listener, one out_link_thread per other node and a reader
+// for every in link adopted from the old process. Runs after takeover so
+// HELLO carries the epoch inherited from it.
+static int start_cluster_threads(void) {
+    int ok = 1;
+    pthread_mutex_lock(&sessions_mutex);
+    if (pthread_create(&cluster_listener, NULL, cluster_listen_thread, NULL) != 0) ok = 0;
+    else pthread_detach(cluster_listener);
+    for (int n = 0; ok && n < cluster_nodes; n++) {
+        if (n == cluster_self) continue;
+        cluster_link_t *link = &out_links[n];
+        link->running = 1;
+        if (pthread_create(&link->thread, NULL, out_link_thread, (void *)(intptr_t)n) != 0) {
+            link->running = 0;
+            ok = 0;
+            break;
+        }
+        pthread_detach(link->thread);
+        if (in_links[n].rd.fd >= 0 && start_in_link_locked(n) < 0) ok = 0;
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+    return ok ? 0 : -1;
+}
+
+// Hot restart state
+static int main_parked = 0;           // sessions_mutex
+static pthread_t main_thread;
+static int listen_fd = -1;
+
+#define HANDOFF_MAGIC 0x54545448u     // "TTTH"
+#define HANDOFF_VERSION 2
+#define HANDOFF_ACK_TIMEOUT 5
+#define HANDOFF_QUIESCE_TIMEOUT 2     // seconds to get every thread parked
+#define HANDOFF_RECV_TIMEOUT 5        // successor waiting on each packet
+
+// Both sides must agree on the layout of every packet. version and the
+// struct sizes catch a binary built with another BUF_SIZE, BOARD_N or
+// CLUSTER_MAX_NODES.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t session_size;
+    uint32_t match_size;
+    uint32_t link_size;
+    uint32_t n_sessions;
+    uint32_t n_matches;
+    uint32_t n_links;
+    uint32_t n_nodes;                 // cluster_nodes of the sender
+    uint32_t membership;              // cluster_membership(n_nodes) of the sender
+    uint32_t cluster_epoch;
+    uint32_t node_epochs[CLUSTER_MAX_NODES];
+} handoff_header_t;
+
+typedef struct {
+    int32_t old_sock;
+    int32_t id;
+    uint32_t linepos;
+    uint32_t line_too_long;
+    char linebuf[BUF_SIZE];
+} handoff_session_t;
+
+typedef struct {
+    int32_t id;
+    int32_t players[2];
+    int32_t board[BOARD_N][BOARD_N];
+    int32_t turn;
+    int32_t is_finished;
+    int32_t winner;
+} handoff_match_t;
+
+// A cluster link or the link listener, passed with its fd and the bytes
+// its reader had buffered but not yet handled
+#define HANDOFF_LINK_OUT 0
+#define HANDOFF_LINK_IN 1
+#define HANDOFF_LINK_LISTEN 2
+typedef struct {
+    int32_t kind;
+    int32_t node;
+    uint32_t len;
+    char buf[BUF_SIZE];
+} handoff_link_t;
+
+// Add a match received from an old process or another node, with its
+// players already translated. Caller holds matches_mutex.
+static match_t *adopt_match_locked(const handoff_match_t *hm, const int players[2]) {
+    match_t *m = create_match_locked(hm->id);
+    if (!m) return NULL;
+    match_write_begin(m);
+    m->players[0] = players[0];
+    m->players[1] = players[1];
+    for (int i = 0; i < BOARD_N; i++)
+        for (int j = 0; j < BOARD_N; j++) m->board[i][j] = hm->board[i][j];
+    m->turn = hm->turn;
+    m->is_finished = hm->is_finished;
+    m->winner = hm->winner;
+    match_write_end(m);
+    if (m->is_finished) finished_push_locked(m);
+    return m;
+}
+
+// Hand every match that node now owns to it as MIG frames, after the node
+// list grew. Only matches on arcs the node took over are moved. Local
+// players become remote ones, named by session id. The caller holds the
+// link mutex from publishing the link on, so no FWD or BYE for these
+// matches overtakes them. If the link fails the rest stay here until it is
+// back up.
+static void cluster_migrate_to(int node) {
+    cluster_link_t *link = &out_links[node];
+    pthread_mutex_lock(&sessions_mutex);
+    pthread_mutex_lock(&matches_mutex);
+    int count = 0;
+    for (match_t *m = atomic_load_explicit(&matches, memory_order_relaxed); m;
+         m = atomic_load_explicit(&m->next, memory_order_relaxed))
+        if (match_owner(m->id) == node) count++;
+    handoff_match_t *hms = count ? calloc(count, sizeof(handoff_match_t)) : NULL;
+    int n_hm = 0;
+    for (match_t *m = atomic_load_explicit(&matches, memory_order_relaxed); hms && m;
+         m = atomic_load_explicit(&m->next, memory_order_relaxed)) {
+        if (match_owner(m->id) != node) continue;
+        handoff_match_t *hm = &hms[n_hm++];
+        hm->id = m->id;
+        for (int p = 0; p < 2; p++) {
+            hm->players[p] = m->players[p];
+            if (hm->players[p] == 0 || is_remote_player(hm->players[p])) continue;
+            hm->players[p] = 0;   // client already gone
+            for (int i = 0; i < MAX_SESSIONS; i++)
+                if (sessions[i].active && sessions[i].sock == m->players[p] && sessions[i].id != 0)
+                    hm->players[p] = remote_player(cluster_self, sessions[i].id);
+        }
+        for (int i = 0; i < BOARD_N; i++)
+            for (int j = 0; j < BOARD_N; j++) hm->board[i][j] = m->board[i][j];
+        hm->turn = m->turn;
+        hm->is_finished = m->is_finished;
+        hm->winner = m->winner;
+    }
+    pthread_mutex_unlock(&matches_mutex);
+    pthread_mutex_unlock(&sessions_mutex);
+
+    // Seats may name sessions on third nodes the new owner has not heard
+    // from yet. Tell it their epochs so their first link is not taken for a
+    // restart that drops those seats.
+    int sent = 0, failed = 0;
+    char header[64];
+    for (int n = 0; n_hm && !failed && n < cluster_nodes; n++) {
+        if (n == node || n == cluster_self) continue;
+        pthread_mutex_lock(&in_links[n].mutex);
+        uint32_t epoch = node_epochs[n];
+        pthread_mutex_unlock(&in_links[n].mutex);
+        if (epoch == 0) continue;
+        snprintf(header, sizeof(header), "EPOCH %d %u", n, epoch);
+        failed = link_send_frame(link, header, "", 0) < 0;
+    }
+    snprintf(header, sizeof(header), "MIG %zu", sizeof(handoff_match_t));
+    while (!failed && sent < n_hm && link_send_frame(link, header, (const char *)&hms[sent], sizeof(handoff_match_t)) == 0) sent++;
+
+    // Commands for these matches go to node now, so only BYEs touched them
+    pthread_mutex_lock(&matches_mutex);
+    for (int i = 0; i < sent; i++) {
+        match_t *m = find_match_locked(hms[i].id);
+        if (m) release_match_locked(m);
+    }
+    pthread_mutex_unlock(&matches_mutex);
+    if (n_hm) log_message("CLUSTER MIGRATE: %d of %d matches to node %d", sent, n_hm, node);
+    free(hms);
+}
+
+// Owner side: take a match handed over by node under cluster_migrate_to.
+// Its players from this node become local sockets again.
+static void cluster_adopt_match(int node, const void *payload, size_t len) {
+    handoff_match_t hm;
+    if (len != sizeof(hm)) {
+        log_message("CLUSTER MIGRATE FAIL: bad match from node %d", node);
+        return;
+    }
+    memcpy(&hm, payload, sizeof(hm));
+
+    int players[2];
+    for (int p = 0; p < 2; p++) {
+        players[p] = hm.players[p];
+        if (!is_remote_player(players[p]) || remote_node(players[p]) != cluster_self) continue;
+        int id = remote_session(players[p]);
+        session_t *sess = &sessions[id & (MAX_SESSIONS - 1)];
+        pthread_mutex_lock(&sessions_mutex);
+        players[p] = sess->active && sess->id == id ? sess->sock : 0;
+        pthread_mutex_unlock(&sessions_mutex);
+    }
+
+    pthread_mutex_lock(&matches_mutex);
+    if (find_match_locked(hm.id))
+        log_message("CLUSTER MIGRATE FAIL: match_id=%d from node %d already exists here", hm.id, node);
+    else if (adopt_match_locked(&hm, players))
+        log_message("CLUSTER MIGRATE: match_id=%d from node %d", hm.id, node);
+    pthread_mutex_unlock(&matches_mutex);
+}
+
+// SIGUSR2 only needs to interrupt blocking recv/accept
+static void wake_handler(int sig) {
+    (void)sig;
+}
+
+// Stop this session's thread without closing its socket
+static void park_session(session_t *sess) {
+    pthread_mutex_lock(&sessions_mutex);
+    sess->parked = 1;
+    pthread_cond_broadcast(&sessions_cond);
+    pthread_mutex_unlock(&sessions_mutex);
+}
 
 // Thread to handle client
 void *client_thread(void *arg) {
-    int client_sock = *(int*)arg;
-    free(arg);
+    session_t *sess = arg;
+    int client_sock = sess->sock;
+    int session_id = sess->id;
+    current_session_id = session_id;
 
     char buf[BUF_SIZE];
-    char linebuf[BUF_SIZE];
-    size_t linepos = 0;
+    char *linebuf = sess->linebuf;
 
     while (1) {
+        if (atomic_load(&draining)) {
+            park_session(sess);
+            return NULL;
+        }
         ssize_t n = recv(client_sock, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
         if (n <= 0) break;
+        TRACE_INSTANT("recv", (int)n);
+        if (capture_dir) capture_record(sess, CAPTURE_IN, buf, n);
         for (ssize_t i = 0; i < n; i++) {
-            if (linepos < BUF_SIZE-1) linebuf[linepos++] = buf[i];
+            if (sess->linepos < BUF_SIZE-1) {
+                linebuf[sess->linepos++] = buf[i];
+            } else {
+                // Full: keep the start for the reply and shift the last two
+                // bytes along so the CRLF that ends the line is still seen
+                sess->line_too_long = 1;
+                linebuf[BUF_SIZE-3] = linebuf[BUF_SIZE-2];
+                linebuf[BUF_SIZE-2] = buf[i];
+            }
+            size_t linepos = sess->linepos;
             if (linepos >= 2 && linebuf[linepos-2]=='\r' && linebuf[linepos-1]=='\n') {
                 linebuf[linepos] = '\0';
                 trim_crlf(linebuf);
-                if (strlen(linebuf)>0) handle_line(client_sock, linebuf);
-                linepos = 0;
+                if (sess->line_too_long) {
+                    reject_long_line(client_sock, linebuf);
+                    sess->line_too_long = 0;
+                } else if (strlen(linebuf)>0) {
+                    TRACE_BEGIN("handle_line");
+                    handle_line(client_sock, linebuf);
+                    TRACE_END("handle_line");
+                }
+                sess->linepos = 0;
             }
         }
     }
 
+    // Hide the id from out_link_thread and wait out sends in flight, so a
+    // late reply can never land on a reused fd
+    pthread_mutex_lock(&sessions_mutex);
+    sess->id = 0;
+    while (sess->pins > 0) pthread_cond_wait(&sessions_cond, &sessions_mutex);
+    pthread_mutex_unlock(&sessions_mutex);
+
+    if (capture_dir) capture_close(sess, 1);
     close(client_sock);
     remove_player_from_matches(client_sock);
+    cluster_client_gone(session_id);
+    pthread_mutex_lock(&sessions_mutex);
+    sess->active = 0;
+    pthread_mutex_unlock(&sessions_mutex);
     log_message("CLIENT DISCONNECTED: sock=%d", client_sock);
     printf("[SERVER] Client disconnected: sock=%d\n", client_sock);
     return NULL;
 
 }
 
+// Register a client and start its thread, optionally with a partial line.
+// id is 0 for a new client, or the id an adopted client had before.
+static int start_session(int sock, int id, const char *linebuf, size_t linepos, int line_too_long) {
+    pthread_mutex_lock(&sessions_mutex);
+    session_t *sess = NULL;
+    if (id > 0) {
+        sess = &sessions[id & (MAX_SESSIONS - 1)];
+        if (sess->active) sess = NULL;
+        else sess->gen = (unsigned)id >> SESSION_SLOT_BITS;
+    } else {
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            if (!sessions[i].active) { sess = &sessions[i]; break; }
+        }
+        if (sess) {
+            // gen stays in 1..1023 so the id fits in REMOTE_SESSION_MASK
+            sess->gen = sess->gen % (REMOTE_SESSION_MASK >> SESSION_SLOT_BITS) + 1;
+            id = (int)(sess->gen << SESSION_SLOT_BITS) | (int)(sess - sessions);
+        }
+    }
+    if (!sess) { pthread_mutex_unlock(&sessions_mutex); return -1; }
+
+    sess->sock = sock;
+    sess->id = id;
+    sess->pins = 0;
+    sess->active = 1;
+    sess->parked = 0;
+    sess->linepos = linepos < BUF_SIZE ? linepos : 0;
+    if (sess->linepos) memcpy(sess->linebuf, linebuf, sess->linepos);
+    sess->line_too_long = sess->linepos ? line_too_long : 0;
+    if (capture_dir) capture_open(sess);
+
+    // Held across pthread_create so sess->thread is set before anyone reads it
+    if (pthread_create(&sess->thread, NULL, client_thread, sess) != 0) {
+        if (capture_dir) capture_close(sess, 1);
+        sess->active = 0;
+        pthread_mutex_unlock(&sessions_mutex);
+        return -1;
+    }
+    pthread_detach(sess->thread);
+    pthread_mutex_unlock(&sessions_mutex);
+    return 0;
+}
+
+// Park the accept loop, every client thread and the cluster link readers.
+// A thread may be between its draining check and recv, so keep signaling
+// until all have parked.
+// A thread stuck sending to a client that stopped reading never parks:
+// give up after HANDOFF_QUIESCE_TIMEOUT and return -1, threads that did
+// park stay parked for resume_threads.
+static int quiesce_threads(void) {
+    atomic_store(&draining, 1);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HANDOFF_QUIESCE_TIMEOUT;
+    int busy = 0;
+    pthread_mutex_lock(&sessions_mutex);
+    while (1) {
+        busy = 0;
+        if (!main_parked) { pthread_kill(main_thread, SIGUSR2); busy++; }
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            if (sessions[i].active && !sessions[i].parked) {
+                pthread_kill(sessions[i].thread, SIGUSR2);
+                busy++;
+            }
+        }
+        if (cluster_listen_fd >= 0 && !cluster_listener_parked) { pthread_kill(cluster_listener, SIGUSR2); busy++; }
+        for (int n = 0; n < cluster_nodes; n++) {
+            cluster_link_t *links[2] = { &out_links[n], &in_links[n] };
+            for (int d = 0; d < 2; d++) {
+                if (links[d]->running && !links[d]->parked) { pthread_kill(links[d]->thread, SIGUSR2); busy++; }
+            }
+        }
+        if (!busy) break;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        if (ts.tv_sec > deadline.tv_sec ||
+            (ts.tv_sec == deadline.tv_sec && ts.tv_nsec >= deadline.tv_nsec)) break;
+        ts.tv_nsec += 10 * 1000000;
+        if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+        pthread_cond_timedwait(&sessions_cond, &sessions_mutex, &ts);
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+    return busy ? -1 : 0;
+}
+
+// Undo quiesce_threads after a failed handoff
+static void resume_threads(void) {
+    pthread_mutex_lock(&sessions_mutex);
+    atomic_store(&draining, 0);
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        session_t *sess = &sessions[i];
+        if (!sess->active || !sess->parked) continue;
+        sess->parked = 0;
+        if (pthread_create(&sess->thread, NULL, client_thread, sess) != 0) {
+            // Cannot serve it any more; drop the client like a disconnect
+            if (capture_dir) capture_close(sess, 1);
+            close(sess->sock);
+            sess->active = 0;
+            continue;
+        }
+        pthread_detach(sess->thread);
+    }
+    pthread_cond_broadcast(&sessions_cond);
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+// Send one packet with an optional fd attached (fd < 0 for none)
+static int send_packet(int ctl, const void *buf, size_t len, int fd) {
+    struct iovec iov = { (void *)buf, len };
+    struct msghdr msg = {0};
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    return sendmsg(ctl, &msg, 0) == (ssize_t)len ? 0 : -1;
+}
+
+// Receive one packet of exactly len bytes, and its fd if fd is not NULL.
+// A longer packet is cut short by SOCK_SEQPACKET and flagged MSG_TRUNC.
+static int recv_packet(int ctl, void *buf, size_t len, int *fd) {
+    struct iovec iov = { buf, len };
+    struct msghdr msg = {0};
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t n = recvmsg(ctl, &msg, 0);
+    if (n < 0) return -1;
+
+    int got = -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(&got, CMSG_DATA(cm), sizeof(int));
+    if (n != (ssize_t)len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (got >= 0) close(got);
+        return -1;
+    }
+    if (fd) *fd = got;
+    else if (got >= 0) close(got);
+    return (fd && got < 0) ? -1 : 0;
+}
+
+// Old process side: pass everything to the peer on ctl. Returns 0 once the
+// new process has acknowledged; on failure every thread is resumed.
+static int handoff_to(int ctl) {
+    if (quiesce_threads() < 0) {
+        log_message("HANDOFF FAIL: threads did not park within %d s", HANDOFF_QUIESCE_TIMEOUT);
+        resume_threads();
+        return -1;
+    }
+
+    // out_link_thread may still be writing a reply to a client; let it
+    // finish, and keep it out until we exit or resume
+    pthread_mutex_lock(&sessions_mutex);
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].pins == 0) continue;
+        pthread_cond_wait(&sessions_cond, &sessions_mutex);
+        i = -1;   // others may have pinned meanwhile, rescan
+    }
+    pthread_mutex_lock(&matches_mutex);
+
+    handoff_header_t hdr = { HANDOFF_MAGIC, HANDOFF_VERSION, sizeof(handoff_header_t),
+                             sizeof(handoff_session_t), sizeof(handoff_match_t), sizeof(handoff_link_t),
+                             0, 0, 0, cluster_nodes, cluster_membership(cluster_nodes), cluster_epoch, {0} };
+    for (int n = 0; n < cluster_nodes; n++) {
+        pthread_mutex_lock(&in_links[n].mutex);
+        hdr.node_epochs[n] = node_epochs[n];
+        pthread_mutex_unlock(&in_links[n].mutex);
+    }
+    for (int i = 0; i < MAX_SESSIONS; i++)
+        if (sessions[i].active) hdr.n_sessions++;
+    for (match_t *m = atomic_load(&matches); m; m = atomic_load(&m->next)) hdr.n_matches++;
+    if (cluster_listen_fd >= 0) hdr.n_links++;
+    for (int n = 0; n < cluster_nodes; n++)
+        hdr.n_links += (out_links[n].rd.fd >= 0) + (in_links[n].running && in_links[n].rd.fd >= 0);
+
+    int ok = send_packet(ctl, &hdr, sizeof(hdr), listen_fd) == 0;
+
+    // Every thread is parked, so sessions[] cannot change under us
+    static handoff_session_t hs;
+    for (int i = 0; ok && i < MAX_SESSIONS; i++) {
+        session_t *sess = &sessions[i];
+        if (!sess->active) continue;
+        hs.old_sock = sess->sock;
+        hs.id = sess->id;
+        hs.linepos = sess->linepos;
+        hs.line_too_long = sess->line_too_long;
+        memcpy(hs.linebuf, sess->linebuf, sess->linepos);
+        ok = send_packet(ctl, &hs, sizeof(hs), sess->sock) == 0;
+    }
+
+    for (match_t *m = atomic_load(&matches); ok && m; m = atomic_load(&m->next)) {
+        handoff_match_t hm;
+        hm.id = m->id;
+        hm.players[0] = m->players[0];
+        hm.players[1] = m->players[1];
+        for (int i = 0; i < BOARD_N; i++)
+            for (int j = 0; j < BOARD_N; j++) hm.board[i][j] = m->board[i][j];
+        hm.turn = m->turn;
+        hm.is_finished = m->is_finished;
+        hm.winner = m->winner;
+        ok = send_packet(ctl, &hm, sizeof(hm), -1) == 0;
+    }
+
+    // Link readers are parked at a frame boundary; frames still in their
+    // buffers or the sockets are handled by the successor
+    static handoff_link_t hl;
+    if (ok && cluster_listen_fd >= 0) {
+        hl.kind = HANDOFF_LINK_LISTEN;
+        hl.node = cluster_self;
+        hl.len = 0;
+        ok = send_packet(ctl, &hl, sizeof(hl), cluster_listen_fd) == 0;
+    }
+    for (int n = 0; ok && n < cluster_nodes; n++) {
+        cluster_link_t *links[2] = { &out_links[n], &in_links[n] };
+        for (int d = 0; ok && d < 2; d++) {
+            link_reader_t *rd = &links[d]->rd;
+            if (rd->fd < 0 || (d == 1 && !links[d]->running)) continue;
+            hl.kind = d == 0 ? HANDOFF_LINK_OUT : HANDOFF_LINK_IN;
+            hl.node = n;
+            hl.len = rd->end - rd->start;
+            memcpy(hl.buf, rd->buf + rd->start, hl.len);
+            ok = send_packet(ctl, &hl, sizeof(hl), rd->fd) == 0;
+        }
+    }
+
+    char ack[4];
+    struct timeval tv = { HANDOFF_ACK_TIMEOUT, 0 };
+    setsockopt(ctl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (ok && recv(ctl, ack, sizeof(ack), 0) == 2 && memcmp(ack, "OK", 2) == 0) {
+        log_message("HANDOFF DONE: %u sessions, %u matches", hdr.n_sessions, hdr.n_matches);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&matches_mutex);
+    pthread_mutex_unlock(&sessions_mutex);
+    resume_threads();
+    return -1;
+}
+
+// New process side: adopt the listening socket, clients and matches
+static int takeover_from(const char *path) {
+    int ctl = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (ctl < 0) { perror("socket"); return -1; }
+    struct sockaddr_un ua = {0};
+    ua.sun_family = AF_UNIX;
+    strncpy(ua.sun_path, path, sizeof(ua.sun_path) - 1);
+    if (connect(ctl, (struct sockaddr*)&ua, sizeof(ua)) < 0) {
+        perror("connect handoff"); close(ctl); return -1;
+    }
+
+    struct timeval tv = { HANDOFF_RECV_TIMEOUT, 0 };
+    setsockopt(ctl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    handoff_header_t hdr;
+    if (recv_packet(ctl, &hdr, sizeof(hdr), &listen_fd) < 0) {
+        fprintf(stderr, "Bad handoff header (old process built differently, or timed out)\n");
+        close(ctl);
+        return -1;
+    }
+    if (hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION ||
+        hdr.header_size != sizeof(handoff_header_t) || hdr.session_size != sizeof(handoff_session_t) ||
+        hdr.match_size != sizeof(handoff_match_t) || hdr.link_size != sizeof(handoff_link_t)) {
+        fprintf(stderr, "Handoff refused: incompatible state format (version %u)\n", hdr.version);
+        close(listen_fd);
+        listen_fd = -1;
+        close(ctl);
+        return -1;
+    }
+    // Appending nodes only moves matches to the new ones, which
+    // cluster_migrate_to handles; any other change would strand seats
+    // named by node index
+    if (hdr.n_nodes > (uint32_t)cluster_nodes || hdr.membership != cluster_membership(hdr.n_nodes)) {
+        fprintf(stderr, "Handoff refused: cluster node list must extend the running server's\n");
+        close(listen_fd);
+        listen_fd = -1;
+        close(ctl);
+        return -1;
+    }
+    // Keep the cluster identity so owners keep our clients' seats
+    if (cluster_nodes > 0 && hdr.cluster_epoch != 0) {
+        cluster_epoch = hdr.cluster_epoch;
+        memcpy(node_epochs, hdr.node_epochs, sizeof(node_epochs));
+    }
+
+    // Collect every session and match before any client thread runs, so
+    // nothing is read from an adopted socket until the old process has
+    // been told it can exit
+    handoff_session_t *hs = calloc(hdr.n_sessions + 1, sizeof(handoff_session_t));
+    int *new_socks = calloc(hdr.n_sessions + 1, sizeof(int));
+    uint32_t n = 0;
+    for (; hs && new_socks && n < hdr.n_sessions; n++) {
+        if (recv_packet(ctl, &hs[n], sizeof(hs[n]), &new_socks[n]) < 0) break;
+    }
+
+    uint32_t m_count = 0;
+    pthread_mutex_lock(&matches_mutex);
+    for (; n == hdr.n_sessions && m_count < hdr.n_matches; m_count++) {
+        handoff_match_t hm;
+        if (recv_packet(ctl, &hm, sizeof(hm), NULL) < 0) break;
+        int players[2];
+        for (int p = 0; p < 2; p++) {
+            players[p] = 0;
+            if (is_remote_player(hm.players[p])) { players[p] = hm.players[p]; continue; }
+            for (uint32_t k = 0; k < n; k++)
+                if (hm.players[p] != 0 && hs[k].old_sock == hm.players[p]) players[p] = new_socks[k];
+        }
+        adopt_match_locked(&hm, players);
+    }
+    pthread_mutex_unlock(&matches_mutex);
+
+    // Links go straight into place, so adopted clients can forward from
+    // their first line; the readers start in start_cluster_threads
+    uint32_t l_count = 0;
+    for (; m_count == hdr.n_matches && l_count < hdr.n_links; l_count++) {
+        static handoff_link_t hl;
+        int fd;
+        if (recv_packet(ctl, &hl, sizeof(hl), &fd) < 0) break;
+        cluster_link_t *link = NULL;
+        if (hl.kind == HANDOFF_LINK_LISTEN) cluster_listen_fd = fd;
+        else if (hl.node >= 0 && hl.node < cluster_nodes && hl.node != cluster_self && hl.len <= BUF_SIZE)
+            link = hl.kind == HANDOFF_LINK_OUT ? &out_links[hl.node] : &in_links[hl.node];
+        if (!link) { if (hl.kind != HANDOFF_LINK_LISTEN) close(fd); continue; }
+        link->fd = link->rd.fd = fd;
+        link->rd.start = 0;
+        link->rd.end = hl.len;
+        memcpy(link->rd.buf, hl.buf, hl.len);
+    }
+
+    if (n != hdr.n_sessions || m_count != hdr.n_matches || l_count != hdr.n_links ||
+        send(ctl, "OK", 2, 0) != 2) {
+        // The old process still owns every client, drop our copies
+        fprintf(stderr, "Handoff incomplete\n");
+        for (uint32_t k = 0; k < n; k++) close(new_socks[k]);
+        if (cluster_listen_fd >= 0) close(cluster_listen_fd);
+        cluster_listen_fd = -1;
+        for (int k = 0; k < cluster_nodes; k++) {
+            if (out_links[k].rd.fd >= 0) close(out_links[k].rd.fd);
+            if (in_links[k].rd.fd >= 0) close(in_links[k].rd.fd);
+            out_links[k].fd = out_links[k].rd.fd = -1;
+            in_links[k].fd = in_links[k].rd.fd = -1;
+        }
+        free(hs);
+        free(new_socks);
+        close(ctl);
+        return -1;
+    }
+
+    for (uint32_t k = 0; k < n; k++) {
+        if (start_session(new_socks[k], hs[k].id, hs[k].linebuf, hs[k].linepos, hs[k].line_too_long) < 0) {
+            remove_player_from_matches(new_socks[k]);
+            close(new_socks[k]);
+        }
+    }
+    free(hs);
+    free(new_socks);
+    close(ctl);
+    log_message("HANDOFF RECEIVED: %u sessions, %u matches, %u links", n, m_count, l_count);
+    printf("[SERVER] Took over %u sessions and %u matches\n", n, m_count);
+    return 0;
+}
+
+// Wait for a successor on the handoff socket, then exit
+static void *handoff_thread(void *arg) {
+    int ctl_fd = (int)(intptr_t)arg;
+    while (1) {
+        int ctl = accept(ctl_fd, NULL, NULL);
+        if (ctl < 0) {
+            if (errno == EINTR) continue;
+            perror("accept handoff");
+            return NULL;
+        }
+        log_message("HANDOFF START");
+        if (handoff_to(ctl) == 0) {
+            // The successor opens fresh capture files for adopted sessions
+            for (int i = 0; capture_dir && i < MAX_SESSIONS; i++)
+                if (sessions[i].active) capture_close(&sessions[i], 0);
+            printf("[SERVER] Handed off to new process, exiting\n");
+            fflush(stdout);
+            _exit(0);
+        }
+        log_message("HANDOFF FAIL: resuming");
+        close(ctl);
+    }
+    return NULL;
+}
+
+// Listen for a successor at path, replacing any stale socket file
+static int start_handoff_listener(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+    struct sockaddr_un ua = {0};
+    ua.sun_family = AF_UNIX;
+    strncpy(ua.sun_path, path, sizeof(ua.sun_path) - 1);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&ua, sizeof(ua)) < 0 || listen(fd, 1) < 0) {
+        perror("bind handoff"); close(fd); return -1;
+    }
+    pthread_t th;
+    if (pthread_create(&th, NULL, handoff_thread, (void *)(intptr_t)fd) != 0) { close(fd); return -1; }
+    pthread_detach(th);
+    return 0;
+}
+
 // Main function
 int main(int argc, char *argv[]) {
-    if (argc<2) { fprintf(stderr,"Usage: %s <port>\n", argv[0]); return 1; }
+    if (argc<2) { fprintf(stderr,"Usage: %s <port> [--handoff <path> [--takeover]] [--cluster <host:port,...> --node <index>] [--capture <dir>]\n", argv[0]); return 1; }
     int port = atoi(argv[1]);
 
+    const char *handoff_path = NULL;
+    const char *cluster_spec = NULL;
+    int takeover = 0;
+    int node = -1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) handoff_path = argv[++i];
+        else if (strcmp(argv[i], "--takeover") == 0) takeover = 1;
+        else if (strcmp(argv[i], "--cluster") == 0 && i + 1 < argc) cluster_spec = argv[++i];
+        else if (strcmp(argv[i], "--node") == 0 && i + 1 < argc) node = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) capture_dir = argv[++i];
+        else { fprintf(stderr,"Usage: %s <port> [--handoff <path> [--takeover]] [--cluster <host:port,...> --node <index>] [--capture <dir>]\n", argv[0]); return 1; }
+    }
+    if (takeover && !handoff_path) { fprintf(stderr, "--takeover needs --handoff <path>\n"); return 1; }
+    if (cluster_spec && node < 0) { fprintf(stderr, "--cluster needs --node <index>\n"); return 1; }
+
+#ifdef TRACE_ENABLED
+    trace_init();
+#endif
+
+    for (int i = 0; i < MAX_SESSIONS; i++) pthread_mutex_init(&sessions[i].capture_mutex, NULL);
+
+    main_thread = pthread_self();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_handler;   // no SA_RESTART: recv/accept return EINTR
+    sigaction(SIGUSR2, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);       // peers and cluster links may vanish mid-send
+
     // Initialize log file
     log_file = fopen("server.log", "a");
     if (log_file) {
@@ -506,49 +2331,74 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Warning: cannot open log file server.log\n");
     }
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) { perror("socket"); return 1; }
+    // Before takeover so adopted clients are routed from their first line
+    if (cluster_spec && start_cluster(cluster_spec, node) < 0) {
+        fprintf(stderr, "Bad cluster spec or node index\n");
+        return 1;
+    }
 
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (takeover) {
+        if (takeover_from(handoff_path) < 0) return 1;
+    } else {
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0) { perror("socket"); return 1; }
 
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
+        int opt = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-    if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr))<0) {
-        perror("bind"); close(server_fd); return 1;
+        struct sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+
+        if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr))<0) {
+            perror("bind"); close(listen_fd); return 1;
+        }
+
+        if (listen(listen_fd, BACKLOG)<0) { perror("listen"); close(listen_fd); return 1; }
     }
 
-    if (listen(server_fd, BACKLOG)<0) { perror("listen"); close(server_fd); return 1; }
+    if (cluster_spec && start_cluster_threads() < 0) {
+        fprintf(stderr, "Cannot start cluster links\n");
+        return 1;
+    }
+
+    if (handoff_path && start_handoff_listener(handoff_path) < 0) {
+        fprintf(stderr, "Warning: hot restart disabled, cannot listen on %s\n", handoff_path);
+    }
 
     log_message("SERVER LISTENING on port %d", port);
     printf("[SERVER] Listening on port %d...\n", port);
 
     while(1) {
+        if (atomic_load(&draining)) { park_while_draining(&main_parked); continue; }
+
         struct sockaddr_in cli_addr;
         socklen_t cli_len = sizeof(cli_addr);
-        int *client_sock = malloc(sizeof(int));
-        if (!client_sock) continue;
-        *client_sock = accept(server_fd, (struct sockaddr*)&cli_addr, &cli_len);
-        if (*client_sock < 0) { perror("accept"); free(client_sock); continue; }
+        int client_sock = accept(listen_fd, (struct sockaddr*)&cli_addr, &cli_len);
+        if (client_sock < 0) {
+            if (errno != EINTR) perror("accept");
+            continue;
+        }
 
         char ipstr[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &cli_addr.sin_addr, ipstr, sizeof(ipstr));
-        log_message("CLIENT CONNECTED: %s:%d (sock=%d)", ipstr, ntohs(cli_addr.sin_port), *client_sock);
+        log_message("CLIENT CONNECTED: %s:%d (sock=%d)", ipstr, ntohs(cli_addr.sin_port), client_sock);
         printf("[SERVER] Client connected: %s:%d\n", ipstr, ntohs(cli_addr.sin_port));
 
-        pthread_t th;
-        pthread_create(&th, NULL, client_thread, client_sock);
-        pthread_detach(th);
+        int one = 1;   // replies are already coalesced, don't let Nagle hold them
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (start_session(client_sock, 0, NULL, 0, 0) < 0) {
+            send_status(client_sock, STR_SERVER_ERROR);
+            close(client_sock);
+        }
     }
 
-    close(server_fd);
+    close(listen_fd);
     if (log_file) {
         log_message("SERVER STOPPED");
         fclose(log_file);
     }
     return 0;
 }
-
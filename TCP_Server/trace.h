@@ -0,0 +1,203 @@
+// trace.h
+// Hot-path tracepoints for server.c, compiled in with -DTRACE_ENABLED
+// (make TRACE=1). Without it every macro expands to nothing.
+//
+// Each thread records into its own ring buffer with no locks, using TSC
+// timestamps on x86. Recording starts disabled unless TTT_TRACE=1 is set
+// and can be switched with the TRACE command. Rings are written to
+// Chrome trace JSON (chrome://tracing, ui.perfetto.dev) on SIGUSR1 or
+// TRACE DUMP. The server only takes TRACE from loopback clients and at
+// most one dump per second.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef TRACE_ENABLED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TRACE_RING_SIZE 65536   // events per thread, power of two
+
+typedef struct {
+    uint64_t ts;
+    const char *name;
+    int arg;
+    int tid;
+    char ph;                    // 'B' begin, 'E' end, 'i' instant
+} trace_event_t;
+
+typedef struct trace_ring_t {
+    trace_event_t events[TRACE_RING_SIZE];
+    atomic_ulong head;          // total events written, only the owner stores
+    atomic_int in_use;          // 0 once the owning thread has exited
+    struct trace_ring_t *next;
+} trace_ring_t;
+
+static atomic_int trace_on = 0;
+static __thread trace_ring_t *trace_tls = NULL;
+static __thread int trace_tid = 0;
+static pthread_mutex_t trace_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings = NULL;
+static pthread_key_t trace_key;
+static uint64_t trace_ts0 = 0;
+static double trace_ticks_per_us = 1000.0;
+static atomic_int trace_dump_seq = 0;
+
+static inline uint64_t trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Thread exit: hand the ring to the next thread that needs one
+static void trace_ring_release(void *arg) {
+    trace_ring_t *ring = arg;
+    atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+}
+
+// Slow path, once per thread: reuse an idle ring or register a new one
+static trace_ring_t *trace_ring_acquire(void) {
+    trace_ring_t *ring = NULL;
+    pthread_mutex_lock(&trace_rings_mutex);
+    for (trace_ring_t *r = trace_rings; r; r = r->next) {
+        int idle = 0;
+        if (atomic_compare_exchange_strong(&r->in_use, &idle, 1)) { ring = r; break; }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        if (ring) {
+            atomic_store(&ring->in_use, 1);
+            ring->next = trace_rings;
+            trace_rings = ring;
+        }
+    }
+    pthread_mutex_unlock(&trace_rings_mutex);
+
+    if (ring) pthread_setspecific(trace_key, ring);
+    trace_tid = (int)syscall(SYS_gettid);
+    trace_tls = ring;
+    return ring;
+}
+
+static inline void trace_emit(const char *name, char ph, int arg) {
+    if (!atomic_load_explicit(&trace_on, memory_order_relaxed)) return;
+    trace_ring_t *ring = trace_tls;
+    if (!ring && !(ring = trace_ring_acquire())) return;
+
+    unsigned long h = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event_t *ev = &ring->events[h & (TRACE_RING_SIZE - 1)];
+    ev->ts = trace_now();
+    ev->name = name;
+    ev->arg = arg;
+    ev->tid = trace_tid;
+    ev->ph = ph;
+    atomic_store_explicit(&ring->head, h + 1, memory_order_release);
+}
+
+// Write all rings to path as Chrome trace JSON. Events older than one
+// ring length are gone; the oldest few may be torn if their thread is
+// still writing.
+static int trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+
+    int pid = (int)getpid();
+    int first = 1;
+    fprintf(f, "{\"traceEvents\":[\n");
+    pthread_mutex_lock(&trace_rings_mutex);
+    for (trace_ring_t *r = trace_rings; r; r = r->next) {
+        unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned long start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (unsigned long i = start; i < head; i++) {
+            const trace_event_t *ev = &r->events[i & (TRACE_RING_SIZE - 1)];
+            double us = (double)(ev->ts - trace_ts0) / trace_ticks_per_us;
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s",
+                    first ? "" : ",\n", ev->name, ev->ph, us, pid, ev->tid,
+                    ev->ph == 'i' ? ",\"s\":\"t\"" : "");
+            if (ev->arg) fprintf(f, ",\"args\":{\"v\":%d}", ev->arg);
+            fprintf(f, "}");
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&trace_rings_mutex);
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// Dump to trace-<pid>-<n>.json, path written to out
+static int trace_dump_next(char *out, size_t out_size) {
+    snprintf(out, out_size, "trace-%d-%d.json", (int)getpid(), atomic_fetch_add(&trace_dump_seq, 1));
+    return trace_dump(out);
+}
+
+static void trace_set_enabled(int on) {
+    atomic_store_explicit(&trace_on, on, memory_order_relaxed);
+}
+
+// SIGUSR1 is blocked everywhere and consumed here, so dumping never
+// runs inside a signal handler
+static void *trace_signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0) {
+        char path[64];
+        if (trace_dump_next(path, sizeof(path)) == 0)
+            printf("[SERVER] Trace written to %s\n", path);
+    }
+    return NULL;
+}
+
+// Call from main before any other thread is created
+static void trace_init(void) {
+    pthread_key_create(&trace_key, trace_ring_release);
+
+    // Calibrate TSC ticks against the monotonic clock
+    struct timespec a, b, nap = { 0, 20 * 1000000 };
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    uint64_t t0 = trace_now();
+    nanosleep(&nap, NULL);
+    uint64_t t1 = trace_now();
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    double us = (b.tv_sec - a.tv_sec) * 1e6 + (b.tv_nsec - a.tv_nsec) / 1e3;
+    if (us > 0 && t1 > t0) trace_ticks_per_us = (double)(t1 - t0) / us;
+    trace_ts0 = t0;
+
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t th;
+    if (pthread_create(&th, NULL, trace_signal_thread, &set) == 0) pthread_detach(th);
+
+    const char *env = getenv("TTT_TRACE");
+    if (env && env[0] == '1') trace_set_enabled(1);
+}
+
+#define TRACE_BEGIN(name) trace_emit(name, 'B', 0)
+#define TRACE_END(name) trace_emit(name, 'E', 0)
+#define TRACE_INSTANT(name, arg) trace_emit(name, 'i', arg)
+
+#else
+
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_INSTANT(name, arg) ((void)0)
+
+#endif // TRACE_ENABLED
+
+#endif // TRACE_H